@@ -0,0 +1,130 @@
+#include <Asula/HttpServer.hpp>
+#include <Logger/Logger.h>
+#include <boost/asio.hpp>
+#include <iostream>
+#include <thread>
+#include <vector>
+#include <array>
+#include <set>
+#include <mutex>
+#include <atomic>
+#include <chrono>
+#include <cstdlib>
+
+/**
+ * Requests per second of a /ping hook served in shared mode (one io_context for all threads)
+ * and in sharded mode (one io_context and one SO_REUSEPORT acceptor per thread), at 1, 4 and 16 threads.
+ * Clients are keep-alive connections in the same process, one thread each, every one sends its requests back to back.
+ *
+ * Usage: HttpServerBench [connections=64] [requests per connection=2000] [rounds=3] [port=18600]
+ */
+namespace
+{
+    namespace net = boost::asio;
+    using tcp = net::ip::tcp;
+
+    struct Result
+    {
+        uint64_t requests{ 0 };
+        double seconds{ 0 };
+        // Threads of the server that ran the hook at least once
+        size_t servingThreads{ 0 };
+    };
+
+    Result run(int threads, bool sharded, int port, int connections, int requests)
+    {
+        // A thread takes the lock once per run, on its first request, so the measured path stays lock free
+        static std::atomic<int> runs{ 0 };
+        const int generation = ++runs;
+        std::mutex mutex;
+        std::set<std::thread::id> serving;
+        http::Server server("./www", threads);
+        server.setSharded(sharded);
+        server.hook("GET", "/ping", [&, generation](const http::SessionPtr& session)
+        {
+            thread_local int recorded = 0;
+            if (recorded != generation)
+            {
+                recorded = generation;
+                std::lock_guard<std::mutex> lock(mutex);
+                serving.insert(std::this_thread::get_id());
+            }
+            session->replyText("pong");
+        });
+        std::thread listener([&]
+        {
+            server.listen(port);
+        });
+        std::this_thread::sleep_for(std::chrono::milliseconds(200));
+
+        static const std::string REQUEST = "GET /ping HTTP/1.1\r\nHost: localhost\r\n\r\n";
+        std::atomic<uint64_t> done{ 0 };
+        std::vector<std::thread> clients;
+        const auto start = std::chrono::steady_clock::now();
+        for (int c = 0; c < connections; ++c)
+        {
+            clients.emplace_back([&]
+            {
+                boost::system::error_code ec;
+                net::io_context io;
+                tcp::socket socket(io);
+                socket.connect({ net::ip::address_v4::loopback(), (uint16_t)port }, ec);
+                if (ec)
+                {
+                    LOG_ERROR("Connect failed, port={}, err={}", port, ec.message());
+                    return;
+                }
+                socket.set_option(tcp::no_delay(true), ec);
+                // The response is small enough to arrive in one segment
+                std::array<char, 1024> buffer{};
+                for (int i = 0; i < requests; ++i)
+                {
+                    net::write(socket, net::buffer(REQUEST), ec);
+                    auto length = ec ? 0 : socket.read_some(net::buffer(buffer), ec);
+                    if (ec || length == 0)
+                    {
+                        LOG_ERROR("Request failed, port={}, err={}", port, ec.message());
+                        return;
+                    }
+                    done += 1;
+                }
+            });
+        }
+        for (auto& t : clients)
+        {
+            t.join();
+        }
+        Result result{ done, std::chrono::duration<double>(std::chrono::steady_clock::now() - start).count(), 0 };
+
+        server.stop();
+        listener.join();
+        result.servingThreads = serving.size();
+        return result;
+    }
+}
+
+int main(int argc, char** argv)
+{
+    const int connections = argc > 1 ? std::atoi(argv[1]) : 64;
+    const int requests = argc > 2 ? std::atoi(argv[2]) : 2000;
+    const int rounds = argc > 3 ? std::atoi(argv[3]) : 3;
+    int port = argc > 4 ? std::atoi(argv[4]) : 18600;
+
+    std::cout << "cores=" << std::thread::hardware_concurrency() << ", connections=" << connections
+              << ", requests per connection=" << requests << ", rounds=" << rounds << std::endl;
+    for (int threads : { 1, 4, 16 })
+    {
+        for (bool sharded : { false, true })
+        {
+            for (int round = 0; round < rounds; ++round)
+            {
+                // A fresh port per run, the sockets of the previous one may still be in TIME_WAIT
+                auto r = run(threads, sharded, port++, connections, requests);
+                std::cout << (sharded ? "sharded" : "shared ") << " threads=" << threads << " round=" << round
+                          << " requests=" << r.requests << " rps=" << (uint64_t)(r.requests / r.seconds)
+                          << " serving threads=" << r.servingThreads << std::endl;
+            }
+        }
+    }
+    return 0;
+}
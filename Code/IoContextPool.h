@@ -0,0 +1,179 @@
+#pragma once
+
+#include <Logger/Logger.h>
+#include <boost/asio/io_context.hpp>
+#include <boost/asio/executor_work_guard.hpp>
+#include <memory>
+#include <vector>
+#include <thread>
+#include <atomic>
+#include <algorithm>
+
+#ifdef __linux__
+#include <pthread.h>
+#include <sched.h>
+#elif defined(_WIN32)
+#include <windows.h>
+#endif
+
+class IoContextPool final
+{
+    using Guard = boost::asio::executor_work_guard<boost::asio::io_context::executor_type>;
+
+public:
+    // cpus[i % cpus.size()] is the core thread i is pinned to, empty leaves scheduling to the OS
+    explicit IoContextPool(size_t size = std::thread::hardware_concurrency(), std::vector<int> cpus = {})
+        : loads_(new std::atomic<size_t>[std::max<size_t>(size, 1)])
+        , cpus_(std::move(cpus))
+    {
+        size = std::max<size_t>(size, 1);
+        for (size_t i = 0; i < size; ++i)
+        {
+            auto io = std::make_shared<boost::asio::io_context>(1);
+            guards_.emplace_back(boost::asio::make_work_guard(*io));
+            ios_.push_back(std::move(io));
+            loads_[i] = 0;
+        }
+    }
+
+    IoContextPool(const IoContextPool&) = delete;
+    IoContextPool& operator=(const IoContextPool&) = delete;
+
+    ~IoContextPool()
+    {
+        stop();
+    }
+
+public:
+    // One entry per core, for a pool with one pinned thread per core
+    static std::vector<int> allCpus()
+    {
+        std::vector<int> cpus(std::max(std::thread::hardware_concurrency(), 1u));
+        for (size_t i = 0; i < cpus.size(); ++i)
+        {
+            cpus[i] = (int)i;
+        }
+        return cpus;
+    }
+
+    void run()
+    {
+        if (!threads_.empty())
+        {
+            return;
+        }
+        running_ = true;
+        for (size_t i = 0; i < ios_.size(); ++i)
+        {
+            auto io = ios_[i];
+            threads_.emplace_back([io]
+            {
+                boost::system::error_code ec;
+                io->run(ec);
+            });
+            if (!cpus_.empty())
+            {
+                pin(threads_.back(), cpus_[i % cpus_.size()]);
+            }
+        }
+    }
+
+    void stop()
+    {
+        running_ = false;
+        guards_.clear();
+        for (auto& io : ios_)
+        {
+            io->stop();
+        }
+        for (auto& t : threads_)
+        {
+            if (t.joinable())
+            {
+                t.join();
+            }
+        }
+        threads_.clear();
+    }
+
+    // Round robin, one io_context per thread so handlers of a connection never migrate
+    boost::asio::io_context& next()
+    {
+        return *ios_[next_++ % ios_.size()];
+    }
+
+    boost::asio::io_context& at(size_t index)
+    {
+        return *ios_.at(index);
+    }
+
+    // Index of the least loaded io_context, its load is increased until release
+    size_t acquire(size_t weight = 1)
+    {
+        size_t index = 0;
+        for (size_t i = 1; i < ios_.size(); ++i)
+        {
+            if (loads_[i] < loads_[index])
+            {
+                index = i;
+            }
+        }
+        loads_[index] += weight;
+        return index;
+    }
+
+    void release(size_t index, size_t weight = 1)
+    {
+        loads_[index] -= weight;
+    }
+
+    [[nodiscard]] size_t load(size_t index) const
+    {
+        return loads_[index];
+    }
+
+    [[nodiscard]] size_t size() const
+    {
+        return ios_.size();
+    }
+
+    // False once stopped, handlers still queued on it are never run
+    [[nodiscard]] bool isRunning() const
+    {
+        return running_;
+    }
+
+private:
+    static void pin(std::thread& t, int cpu)
+    {
+#ifdef __linux__
+        cpu_set_t set;
+        CPU_ZERO(&set);
+        CPU_SET(cpu, &set);
+        int err = pthread_setaffinity_np(t.native_handle(), sizeof(set), &set);
+        if (err != 0)
+        {
+            LOG_WARN("Set thread affinity failed, cpu={}, err={}", cpu, err);
+        }
+#elif defined(_WIN32)
+        if (SetThreadAffinityMask((HANDLE)t.native_handle(), (DWORD_PTR)1 << cpu) == 0)
+        {
+            LOG_WARN("Set thread affinity failed, cpu={}, err={}", cpu, GetLastError());
+        }
+#else
+        LOG_WARN("Thread affinity is not supported, cpu={}", cpu);
+#endif
+    }
+
+private:
+    // Declared first, handlers destroyed with the io_contexts may still release their load
+    std::unique_ptr<std::atomic<size_t>[]> loads_;
+    std::vector<std::shared_ptr<boost::asio::io_context>> ios_;
+    std::vector<Guard> guards_;
+    std::vector<std::thread> threads_;
+    std::vector<int> cpus_;
+    std::atomic<size_t> next_{ 0 };
+    std::atomic<bool> running_{ false };
+};
+
+using IoContextPoolPtr = std::shared_ptr<IoContextPool>;
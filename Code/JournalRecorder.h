@@ -0,0 +1,313 @@
+#pragma once
+
+#include "Message.h"
+#include <Logger/Logger.h>
+#include <boost/lockfree/queue.hpp>
+#include <boost/interprocess/file_mapping.hpp>
+#include <boost/interprocess/mapped_region.hpp>
+#include <filesystem>
+#include <fstream>
+#include <memory>
+#include <thread>
+#include <atomic>
+#include <chrono>
+#include <string>
+#include <cstring>
+#include <cerrno>
+#include <cstdint>
+
+#ifndef _WIN32
+#include <fcntl.h>
+#include <unistd.h>
+#endif
+
+/**
+ * Append only binary journal of inbound messages.
+ *
+ * Segment layout, host byte order:
+ *   header: char magic[8] = "SOCKJRNL", uint32 version, uint8 protocol (0 udp, 1 tcp), 3 reserved bytes
+ *   record: uint32 size, uint32 connection, int64 time in nanoseconds since epoch, size bytes payload
+ * Segments are preallocated and zero filled, a zero size marks the end of a segment that was not closed.
+ * Preallocation reserves the disk blocks, a full disk fails the roll instead of faulting a write through the mapping.
+ * A segment is a valid PcapMockTask file, PcapReader replays it with the recorded timing.
+ */
+class JournalRecorder final
+{
+public:
+    static constexpr char MAGIC[8] = { 'S', 'O', 'C', 'K', 'J', 'R', 'N', 'L' };
+    static constexpr uint32_t VERSION = 1;
+    static constexpr size_t HEADER_LEN = 16;
+    static constexpr size_t RECORD_HEADER_LEN = 16;
+
+    enum Protocol : uint8_t
+    {
+        Udp,
+        Tcp
+    };
+
+    struct Stats
+    {
+        uint64_t records{ 0 };
+        uint64_t bytes{ 0 };
+        uint64_t dropped{ 0 };
+        uint32_t segments{ 0 };
+    };
+
+public:
+    explicit JournalRecorder(size_t queueCapacity = 65536)
+        : queue_(queueCapacity)
+    {
+
+    }
+
+    JournalRecorder(const JournalRecorder&) = delete;
+    JournalRecorder& operator=(const JournalRecorder&) = delete;
+
+    ~JournalRecorder()
+    {
+        close();
+    }
+
+public:
+    // Segments are named <dir>/<name>.<sequence>.journal
+    bool open(const std::string& dir, const std::string& name, Protocol protocol, size_t segmentSize = 256 * 1024 * 1024)
+    {
+        if (writer_.joinable())
+        {
+            LOG_WARN("Duplicate open journal, name={}", name);
+            return false;
+        }
+        std::error_code ec;
+        std::filesystem::create_directories(dir, ec);
+        if (ec)
+        {
+            LOG_ERROR("Create journal directory failed, dir={}, err={}", dir, ec.message());
+            return false;
+        }
+        dir_ = dir;
+        name_ = name;
+        protocol_ = protocol;
+        segmentSize_ = std::max(segmentSize, HEADER_LEN + RECORD_HEADER_LEN);
+        sequence_ = 0;
+        if (!roll(0))
+        {
+            return false;
+        }
+        running_ = true;
+        writer_ = std::thread(&JournalRecorder::doWrite, this);
+        LOG_INFO("Journal recorder started, dir={}, name={}, segment size={}", dir, name, segmentSize_);
+        return true;
+    }
+
+    void close()
+    {
+        running_ = false;
+        // An append that saw running_ before it was cleared finishes its push before the queue is drained
+        while (appending_ > 0)
+        {
+            std::this_thread::yield();
+        }
+        if (writer_.joinable())
+        {
+            writer_.join();
+            // The writer may have seen an empty queue just before the last pushes
+            MessagePool::Block* block = nullptr;
+            while (queue_.pop(block))
+            {
+                write(block);
+                MessagePool::instance().release(block);
+            }
+            seal();
+            LOG_INFO("Journal recorder stopped, records={}, bytes={}, dropped={}, segments={}", records_, bytes_, dropped_, sequence_);
+        }
+    }
+
+    // Called from network threads, copies the message into a MessagePool block and never blocks, drops when the queue is full
+    void append(uint32_t connection, const uint8_t* data, size_t size)
+    {
+        // Counted before running_ is checked, close sees either this append or its own store
+        appending_ += 1;
+        if (!running_)
+        {
+            appending_ -= 1;
+            return;
+        }
+        auto now = std::chrono::duration_cast<std::chrono::nanoseconds>(std::chrono::system_clock::now().time_since_epoch()).count();
+        auto& pool = MessagePool::instance();
+        auto block = pool.allocate(RECORD_HEADER_LEN + size);
+        auto entry = reinterpret_cast<Entry*>(block->data());
+        entry->size = (uint32_t)size;
+        entry->connection = connection;
+        entry->time = now;
+        memcpy(entry + 1, data, size);
+        if (!queue_.bounded_push(block))
+        {
+            pool.release(block);
+            dropped_ += 1;
+        }
+        appending_ -= 1;
+    }
+
+    [[nodiscard]] Stats stats() const
+    {
+        return Stats{ records_, bytes_, dropped_, sequence_ };
+    }
+
+private:
+    // Record header followed in the same block by the payload
+    struct Entry
+    {
+        uint32_t size;
+        uint32_t connection;
+        int64_t time;
+    };
+    static_assert(sizeof(Entry) == RECORD_HEADER_LEN, "Entry must match the record header");
+
+    void doWrite()
+    {
+        int idle = 0;
+        for (;;)
+        {
+            MessagePool::Block* block = nullptr;
+            if (queue_.pop(block))
+            {
+                idle = 0;
+                write(block);
+                MessagePool::instance().release(block);
+                continue;
+            }
+            if (!running_)
+            {
+                break;
+            }
+            // Spin shortly then back off, the queue is never waited on by producers
+            if (++idle < 64)
+            {
+                std::this_thread::yield();
+            }
+            else
+            {
+                std::this_thread::sleep_for(std::chrono::milliseconds(1));
+            }
+        }
+    }
+
+    void write(MessagePool::Block* block)
+    {
+        const auto entry = reinterpret_cast<const Entry*>(block->data());
+        const size_t len = RECORD_HEADER_LEN + entry->size;
+        if (used_ + len > region_.get_size() && !roll(len))
+        {
+            dropped_ += 1;
+            return;
+        }
+        auto dst = static_cast<uint8_t*>(region_.get_address()) + used_;
+        memcpy(dst, entry, len);
+        used_ += len;
+        records_ += 1;
+        bytes_ += entry->size;
+    }
+
+    // Seal the current segment and preallocate the next one, large enough for the pending record
+    bool roll(size_t pending)
+    {
+        namespace bi = boost::interprocess;
+        seal();
+
+        path_ = fmt::format("{}/{}.{:06d}.journal", dir_, name_, sequence_);
+        const size_t capacity = std::max(segmentSize_, HEADER_LEN + pending);
+        if (!reserve(path_, capacity))
+        {
+            return false;
+        }
+        try
+        {
+            file_ = bi::file_mapping(path_.c_str(), bi::read_write);
+            region_ = bi::mapped_region(file_, bi::read_write);
+        }
+        catch (const std::exception& e)
+        {
+            LOG_ERROR("Create journal segment failed, path={}, err={}", path_, e.what());
+            return false;
+        }
+
+        auto dst = static_cast<uint8_t*>(region_.get_address());
+        memcpy(dst, MAGIC, sizeof(MAGIC));
+        memcpy(dst + 8, &VERSION, sizeof(VERSION));
+        dst[12] = protocol_;
+        used_ = HEADER_LEN;
+        sequence_ += 1;
+        return true;
+    }
+
+    // Create the file with its blocks allocated, a sparse file would only allocate them when the mapping is written
+    static bool reserve(const std::string& path, size_t capacity)
+    {
+#ifdef _WIN32
+        // NTFS allocates the extended range, it is not sparse unless asked to
+        std::error_code ec;
+        {
+            std::ofstream ofs(path, std::ios::binary | std::ios::trunc);
+        }
+        std::filesystem::resize_file(path, capacity, ec);
+        if (ec)
+        {
+            LOG_ERROR("Preallocate journal segment failed, path={}, size={}, err={}", path, capacity, ec.message());
+            return false;
+        }
+#else
+        int fd = ::open(path.c_str(), O_RDWR | O_CREAT | O_TRUNC, 0644);
+        if (fd < 0)
+        {
+            LOG_ERROR("Create journal segment failed, path={}, err={}", path, strerror(errno));
+            return false;
+        }
+        int err = ::posix_fallocate(fd, 0, (off_t)capacity);
+        ::close(fd);
+        if (err != 0)
+        {
+            LOG_ERROR("Preallocate journal segment failed, path={}, size={}, err={}", path, capacity, strerror(err));
+            std::error_code ec;
+            std::filesystem::remove(path, ec);
+            return false;
+        }
+#endif
+        return true;
+    }
+
+    void seal()
+    {
+        namespace bi = boost::interprocess;
+        if (region_.get_address() == nullptr)
+        {
+            return;
+        }
+        region_.flush();
+        region_ = bi::mapped_region();
+        file_ = bi::file_mapping();
+        std::error_code ec;
+        std::filesystem::resize_file(path_, used_, ec);
+    }
+
+private:
+    boost::lockfree::queue<MessagePool::Block*> queue_;
+    std::thread writer_;
+    std::atomic<bool> running_{ false };
+    std::atomic<size_t> appending_{ 0 };
+
+    std::string dir_;
+    std::string name_;
+    Protocol protocol_{ Tcp };
+    size_t segmentSize_{ 0 };
+    std::string path_;
+    boost::interprocess::file_mapping file_;
+    boost::interprocess::mapped_region region_;
+    size_t used_{ 0 };
+
+    std::atomic<uint32_t> sequence_{ 0 };
+    std::atomic<uint64_t> records_{ 0 };
+    std::atomic<uint64_t> bytes_{ 0 };
+    std::atomic<uint64_t> dropped_{ 0 };
+};
+
+using JournalRecorderPtr = std::shared_ptr<JournalRecorder>;
@@ -0,0 +1,72 @@
+#pragma once
+
+#include <Logger/Logger.h>
+#include <boost/interprocess/file_mapping.hpp>
+#include <boost/interprocess/mapped_region.hpp>
+#include <memory>
+#include <string>
+#include <cstdint>
+
+// Read only memory mapping of a whole file, mapped once and shared by every reader
+class MappedFile final
+{
+public:
+    MappedFile() = default;
+    MappedFile(const MappedFile&) = delete;
+    MappedFile& operator=(const MappedFile&) = delete;
+
+public:
+    bool open(const std::string& path)
+    {
+        namespace bi = boost::interprocess;
+        err_.clear();
+        try
+        {
+            file_ = bi::file_mapping(path.c_str(), bi::read_only);
+            region_ = bi::mapped_region(file_, bi::read_only);
+            region_.advise(bi::mapped_region::advice_sequential);
+            path_ = path;
+            return true;
+        }
+        catch (const bi::interprocess_exception& e)
+        {
+            err_ = fmt::format("Map file failed, path={}, err={}", path, e.what());
+            LOG_ERROR(err_);
+            return false;
+        }
+    }
+
+    [[nodiscard]] const uint8_t* data() const
+    {
+        return static_cast<const uint8_t*>(region_.get_address());
+    }
+
+    [[nodiscard]] size_t size() const
+    {
+        return region_.get_size();
+    }
+
+    // Native file descriptor/handle, usable by sendfile while the mapping is alive
+    [[nodiscard]] boost::interprocess::file_handle_t handle() const
+    {
+        return file_.get_mapping_handle().handle;
+    }
+
+    [[nodiscard]] std::string path() const
+    {
+        return path_;
+    }
+
+    [[nodiscard]] std::string error() const
+    {
+        return err_;
+    }
+
+private:
+    boost::interprocess::file_mapping file_;
+    boost::interprocess::mapped_region region_;
+    std::string path_;
+    std::string err_;
+};
+
+using MappedFilePtr = std::shared_ptr<MappedFile>;
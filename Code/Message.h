@@ -0,0 +1,259 @@
+#pragma once
+
+#include <boost/asio/buffer.hpp>
+#include <array>
+#include <atomic>
+#include <mutex>
+#include <string>
+#include <iterator>
+#include <algorithm>
+#include <new>
+#include <cstring>
+#include <cstdint>
+#include <cassert>
+
+/**
+ * Slab pool of message blocks by size class.
+ * A free block goes back to the list of its class and is reused by the next message of that class,
+ * so a steady flow of messages performs no heap allocation once the slabs are warm.
+ * The pool lives for the whole process, slabs are never returned to the heap.
+ */
+class MessagePool final
+{
+public:
+    static constexpr size_t CLASS_COUNT = 7;
+    static constexpr std::array<uint32_t, CLASS_COUNT> CLASS_SIZES = { 64, 256, 1024, 4096, 16384, 65536, 262144 };
+    static constexpr uint8_t OVERSIZE = 0xFF;
+    static constexpr size_t SLAB_LEN = 1024 * 1024;
+
+    struct Block
+    {
+        std::atomic<uint32_t> refs{ 1 };
+        uint32_t size{ 0 };
+        uint32_t capacity{ 0 };
+        uint8_t sizeClass{ OVERSIZE };
+        Block* next{ nullptr };
+
+        uint8_t* data()
+        {
+            return reinterpret_cast<uint8_t*>(this + 1);
+        }
+    };
+
+public:
+    static MessagePool& instance()
+    {
+        // Leaked on purpose, messages held by static objects may be released after main returns
+        static auto* pool = new MessagePool;
+        return *pool;
+    }
+
+public:
+    Block* allocate(size_t size)
+    {
+        uint8_t c = classOf(size);
+        Block* b = nullptr;
+        if (c == OVERSIZE)
+        {
+            b = new (::operator new(sizeof(Block) + size)) Block;
+            b->capacity = (uint32_t)size;
+        }
+        else
+        {
+            auto& fl = lists_[c];
+            std::lock_guard<std::mutex> lock(fl.mutex);
+            if (fl.head == nullptr)
+            {
+                grow(c);
+            }
+            b = fl.head;
+            fl.head = b->next;
+            b->next = nullptr;
+            b->refs.store(1, std::memory_order_relaxed);
+        }
+        b->size = (uint32_t)size;
+        return b;
+    }
+
+    void release(Block* b)
+    {
+        if (b->sizeClass == OVERSIZE)
+        {
+            b->~Block();
+            ::operator delete(b);
+            return;
+        }
+        auto& fl = lists_[b->sizeClass];
+        std::lock_guard<std::mutex> lock(fl.mutex);
+        b->next = fl.head;
+        fl.head = b;
+    }
+
+    [[nodiscard]] size_t slabCount() const
+    {
+        return slabs_;
+    }
+
+private:
+    struct FreeList
+    {
+        std::mutex mutex;
+        Block* head{ nullptr };
+    };
+
+    MessagePool() = default;
+
+    static uint8_t classOf(size_t size)
+    {
+        for (uint8_t i = 0; i < CLASS_COUNT; ++i)
+        {
+            if (size <= CLASS_SIZES[i])
+            {
+                return i;
+            }
+        }
+        return OVERSIZE;
+    }
+
+    // Called with the class mutex held, carves a new slab into blocks of the class
+    void grow(uint8_t c)
+    {
+        const size_t stride = sizeof(Block) + CLASS_SIZES[c];
+        const size_t count = std::max<size_t>(SLAB_LEN / stride, 4);
+        auto slab = static_cast<uint8_t*>(::operator new(stride * count));
+        auto& fl = lists_[c];
+        for (size_t i = 0; i < count; ++i)
+        {
+            auto b = new (slab + i * stride) Block;
+            b->capacity = CLASS_SIZES[c];
+            b->sizeClass = c;
+            b->next = fl.head;
+            fl.head = b;
+        }
+        slabs_ += 1;
+    }
+
+private:
+    std::array<FreeList, CLASS_COUNT> lists_;
+    std::atomic<size_t> slabs_{ 0 };
+};
+
+
+/**
+ * Immutable, reference counted message bytes from the MessagePool.
+ * Copies share the block, handing one message to many consumers costs an atomic increment each.
+ * Only the creator writes through mutableData() before the message is shared.
+ */
+class Message final
+{
+public:
+    using value_type = uint8_t;
+    using const_iterator = const uint8_t*;
+
+public:
+    Message() = default;
+
+    explicit Message(size_t size)
+        : block_(MessagePool::instance().allocate(size))
+    {
+
+    }
+
+    Message(const uint8_t* data, size_t size)
+        : Message(size)
+    {
+        memcpy(block_->data(), data, size);
+    }
+
+    template<typename InputIt>
+    Message(InputIt first, InputIt last)
+        : Message((size_t)std::distance(first, last))
+    {
+        std::copy(first, last, block_->data());
+    }
+
+    explicit Message(const std::string& text)
+        : Message(reinterpret_cast<const uint8_t*>(text.data()), text.size())
+    {
+
+    }
+
+    Message(const Message& other) noexcept
+        : block_(other.block_)
+    {
+        if (block_ != nullptr)
+        {
+            block_->refs.fetch_add(1, std::memory_order_relaxed);
+        }
+    }
+
+    Message(Message&& other) noexcept
+        : block_(other.block_)
+    {
+        other.block_ = nullptr;
+    }
+
+    Message& operator=(Message other) noexcept
+    {
+        std::swap(block_, other.block_);
+        return *this;
+    }
+
+    ~Message()
+    {
+        if (block_ != nullptr && block_->refs.fetch_sub(1, std::memory_order_acq_rel) == 1)
+        {
+            MessagePool::instance().release(block_);
+        }
+    }
+
+public:
+    [[nodiscard]] const uint8_t* data() const
+    {
+        return block_ == nullptr ? nullptr : block_->data();
+    }
+
+    uint8_t* mutableData()
+    {
+        assert(block_ == nullptr || block_->refs.load() == 1);
+        return block_ == nullptr ? nullptr : block_->data();
+    }
+
+    [[nodiscard]] size_t size() const
+    {
+        return block_ == nullptr ? 0 : block_->size;
+    }
+
+    [[nodiscard]] bool empty() const
+    {
+        return size() == 0;
+    }
+
+    [[nodiscard]] const_iterator begin() const
+    {
+        return data();
+    }
+
+    [[nodiscard]] const_iterator end() const
+    {
+        return data() + size();
+    }
+
+    uint8_t operator[](size_t i) const
+    {
+        return data()[i];
+    }
+
+    [[nodiscard]] boost::asio::const_buffer buffer() const
+    {
+        return boost::asio::const_buffer(data(), size());
+    }
+
+    [[nodiscard]] uint32_t useCount() const
+    {
+        return block_ == nullptr ? 0 : block_->refs.load(std::memory_order_relaxed);
+    }
+
+private:
+    MessagePool::Block* block_{ nullptr };
+};
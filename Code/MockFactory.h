@@ -1,9 +1,170 @@
 #pragma once
 
 #include "MockItf.h"
+#include <Logger/Logger.h>
+#include <boost/dll/shared_library.hpp>
+#include <boost/algorithm/string/case_conv.hpp>
+#include <filesystem>
+#include <functional>
+#include <unordered_map>
+#include <string_view>
+#include <string>
+#include <memory>
+#include <vector>
+#include <algorithm>
+#include <cstdint>
 
-class MockFactory
+using MockPtr = std::shared_ptr<MockItf>;
+
+/**
+ * Registry of mock implementations, built in or loaded from plugin libraries exporting DECLEAR_MOCK.
+ * Names are case insensitive (ASCII): the registry hashes and compares them folded, so create() is a single
+ * hash lookup on the name as given without building a lowered copy. Register everything before creating from other threads.
+ */
+class MockFactory final
 {
+    using Creator = std::function<MockItf*()>;
 
-};
+    struct Entry
+    {
+        Creator creator;
+        // Keeps the plugin mapped while the factory or any instance it created is alive
+        std::shared_ptr<boost::dll::shared_library> lib;
+    };
+
+    static char fold(char c)
+    {
+        return c >= 'A' && c <= 'Z' ? (char)(c - 'A' + 'a') : c;
+    }
+
+    // Lets find() take a string_view without building a std::string per lookup, FNV-1a over the folded name
+    struct NameHash
+    {
+        using is_transparent = void;
+
+        size_t operator()(std::string_view name) const
+        {
+            uint64_t hash = 14695981039346656037ULL;
+            for (char c : name)
+            {
+                hash = (hash ^ (uint8_t)fold(c)) * 1099511628211ULL;
+            }
+            return (size_t)hash;
+        }
+    };
+
+    struct NameEqual
+    {
+        using is_transparent = void;
+
+        bool operator()(std::string_view lhs, std::string_view rhs) const
+        {
+            return lhs.size() == rhs.size() && std::equal(lhs.begin(), lhs.end(), rhs.begin(), [](char a, char b)
+            {
+                return fold(a) == fold(b);
+            });
+        }
+    };
+
+public:
+    MockFactory() = default;
+    MockFactory(const MockFactory&) = delete;
+    MockFactory& operator=(const MockFactory&) = delete;
 
+public:
+    template<typename T>
+    void add(const std::string& name)
+    {
+        static_assert(std::is_base_of<MockItf, T>::value, "Mock must implement MockItf");
+        add(name, Entry{ [] { return new T; }, nullptr });
+    }
+
+    // Loads every shared library of the directory exporting a mock, returns the count of registered mocks
+    size_t loadPlugins(const std::string& dir)
+    {
+        std::error_code ec;
+        size_t count = 0;
+        for (const auto& it : std::filesystem::directory_iterator(dir, ec))
+        {
+            if (it.is_regular_file() && it.path().extension() == boost::dll::shared_library::suffix().string())
+            {
+                count += loadPlugin(it.path().string()) ? 1 : 0;
+            }
+        }
+        if (ec)
+        {
+            LOG_ERROR("Load mock plugins failed, dir={}, err={}", dir, ec.message());
+        }
+        LOG_DEBUG("Load {} mock plugins from {}", count, dir);
+        return count;
+    }
+
+    bool loadPlugin(const std::string& path)
+    {
+        try
+        {
+            auto lib = std::make_shared<boost::dll::shared_library>(path);
+            if (!lib->has(MOCK_NAME_FUNC) || !lib->has(MOCK_CREATE_FUNC))
+            {
+                LOG_DEBUG("Not a mock plugin, path={}", path);
+                return false;
+            }
+            std::string name = lib->get<const char* ()>(MOCK_NAME_FUNC)();
+            auto func = lib->get<MockItf* ()>(MOCK_CREATE_FUNC);
+            add(name, Entry{ func, lib });
+            LOG_INFO("Load mock plugin, name={}, path={}", name, path);
+            return true;
+        }
+        catch (const std::exception& e)
+        {
+            LOG_ERROR("Load mock plugin failed, path={}, err={}", path, e.what());
+            return false;
+        }
+    }
+
+    MockPtr create(std::string_view name) const
+    {
+        auto it = entries_.find(name);
+        if (it == entries_.end())
+        {
+            LOG_ERROR("Mock not registered, name={}", name);
+            return nullptr;
+        }
+        const auto& entry = it->second;
+        auto lib = entry.lib;
+        return MockPtr(entry.creator(), [lib](MockItf* mock)
+        {
+            delete mock;
+        });
+    }
+
+    [[nodiscard]] bool contains(std::string_view name) const
+    {
+        return entries_.find(name) != entries_.end();
+    }
+
+    [[nodiscard]] std::vector<std::string> names() const
+    {
+        std::vector<std::string> names;
+        names.reserve(entries_.size());
+        for (const auto& it : entries_)
+        {
+            names.push_back(it.first);
+        }
+        return names;
+    }
+
+private:
+    void add(const std::string& name, Entry entry)
+    {
+        const auto& lower = boost::to_lower_copy(name);
+        if (entries_.count(lower) != 0)
+        {
+            LOG_WARN("Duplicate register mock, will be override, name={}", lower);
+        }
+        entries_[lower] = std::move(entry);
+    }
+
+private:
+    std::unordered_map<std::string, Entry, NameHash, NameEqual> entries_;
+};
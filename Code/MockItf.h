@@ -1,11 +1,13 @@
 #pragma once
 
 #include "MockTask.h"
+#include "JournalRecorder.h"
+#include "Message.h"
+#include "IoContextPool.h"
 #include <string>
-#include <vector>
 #include <functional>
 
-using Message = std::vector<uint8_t>;
+// Handlers may keep the message, copies share the pooled bytes
 using MessageHandler = std::function<void(const Message&)>;
 
 
@@ -16,7 +18,39 @@ public:
 
 public:
     virtual bool init(MockTaskPtr task, MessageHandler inHandler, MessageHandler outHandler) = 0;
-    virtual void start() = 0;
+    // False when the mock could not load its task or open its socket, stop releases what it took
+    virtual bool start() = 0;
     virtual void stop() = 0;
+
+    // Inbound messages are also appended to the recorder with their connection id, set before start
+    void setRecorder(JournalRecorderPtr recorder)
+    {
+        recorder_ = std::move(recorder);
+    }
+
+    // Run on a shared pool instead of threads of its own, set before start
+    void setIoContextPool(IoContextPoolPtr pool)
+    {
+        sharedPool_ = std::move(pool);
+    }
+
+protected:
+    JournalRecorderPtr recorder_{ nullptr };
+    IoContextPoolPtr sharedPool_{ nullptr };
 };
 
+
+#include <boost/config.hpp>
+
+#define MOCK_NAME_FUNC "getMockName"
+#define MOCK_CREATE_FUNC "createMockInstance"
+
+#define DECLEAR_MOCK(TYPE) \
+extern "C" BOOST_SYMBOL_EXPORT const char* getMockName() \
+{\
+    return #TYPE; \
+}\
+extern "C" BOOST_SYMBOL_EXPORT MockItf* createMockInstance() \
+{\
+    return new TYPE; \
+}
@@ -0,0 +1,115 @@
+#pragma once
+
+#include "MockFactory.h"
+#include "IoContextPool.h"
+#include <Logger/Logger.h>
+#include <algorithm>
+#include <string_view>
+#include <mutex>
+#include <vector>
+
+/**
+ * Runs many mock tasks concurrently on one pool of io_contexts, by default one thread pinned per core.
+ * Every mock is bound to the pool before it starts and takes the least loaded io_context,
+ * so the thread count stays the same however many tasks are running.
+ */
+class MockOrchestrator final
+{
+public:
+    // Empty cpus leaves the threads unpinned
+    explicit MockOrchestrator(size_t threadCount = std::thread::hardware_concurrency(), std::vector<int> cpus = IoContextPool::allCpus())
+        : pool_(std::make_shared<IoContextPool>(threadCount, std::move(cpus)))
+    {
+        pool_->run();
+    }
+
+    MockOrchestrator(const MockOrchestrator&) = delete;
+    MockOrchestrator& operator=(const MockOrchestrator&) = delete;
+
+    ~MockOrchestrator()
+    {
+        // Mocks hand their handlers back through the running pool before it stops
+        stopAll();
+        pool_->stop();
+    }
+
+public:
+    bool run(const MockPtr& mock, MockTaskPtr task, MessageHandler inHandler = nullptr, MessageHandler outHandler = nullptr)
+    {
+        if (mock == nullptr || task == nullptr)
+        {
+            return false;
+        }
+        const auto ip = task->ip;
+        const auto port = task->port;
+        if (!mock->init(std::move(task), std::move(inHandler), std::move(outHandler)))
+        {
+            LOG_ERROR("Init mock failed, address={}:{}", ip, port);
+            return false;
+        }
+        mock->setIoContextPool(pool_);
+        if (!mock->start())
+        {
+            LOG_ERROR("Start mock failed, address={}:{}", ip, port);
+            mock->stop();
+            return false;
+        }
+        std::lock_guard<std::mutex> lock(mutex_);
+        mocks_.push_back(mock);
+        return true;
+    }
+
+    MockPtr run(const MockFactory& factory, std::string_view name, MockTaskPtr task, MessageHandler inHandler = nullptr, MessageHandler outHandler = nullptr)
+    {
+        auto mock = factory.create(name);
+        if (mock == nullptr)
+        {
+            LOG_ERROR("Unknown mock, name={}", name);
+            return nullptr;
+        }
+        return run(mock, std::move(task), std::move(inHandler), std::move(outHandler)) ? mock : nullptr;
+    }
+
+    void stop(const MockPtr& mock)
+    {
+        {
+            std::lock_guard<std::mutex> lock(mutex_);
+            auto it = std::find(mocks_.begin(), mocks_.end(), mock);
+            if (it == mocks_.end())
+            {
+                return;
+            }
+            mocks_.erase(it);
+        }
+        mock->stop();
+    }
+
+    void stopAll()
+    {
+        std::vector<MockPtr> mocks;
+        {
+            std::lock_guard<std::mutex> lock(mutex_);
+            mocks.swap(mocks_);
+        }
+        for (auto& mock : mocks)
+        {
+            mock->stop();
+        }
+    }
+
+    [[nodiscard]] size_t taskCount() const
+    {
+        std::lock_guard<std::mutex> lock(mutex_);
+        return mocks_.size();
+    }
+
+    [[nodiscard]] const IoContextPoolPtr& pool() const
+    {
+        return pool_;
+    }
+
+private:
+    IoContextPoolPtr pool_;
+    mutable std::mutex mutex_;
+    std::vector<MockPtr> mocks_;
+};
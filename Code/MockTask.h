@@ -8,7 +8,8 @@ struct MockTaskItf
     enum Type
     {
         File,
-        Text
+        Text,
+        Pcap
     };
 
     virtual ~MockTaskItf() = default;
@@ -16,7 +17,10 @@ struct MockTaskItf
     Type type;
     std::string ip{ "127.0.0.1" };
     int16_t port{ 0 };
-    int16_t loopCount{ 0 };
+    int16_t loopCount{ 0 }; // <=0 means loop until stopped
+    double packetRate{ 0 }; // packets per second, <=0 means unlimited
+    double byteRate{ 0 }; // bytes per second, <=0 means unlimited
+    uint16_t batchSize{ 1 }; // datagrams per send syscall, 1 disables batching
 };
 
 using MockTaskPtr = std::shared_ptr<MockTaskItf>;
@@ -31,3 +35,10 @@ struct FileMockTask : public MockTaskItf
 {
     std::string filepath;
 };
+
+struct PcapMockTask : public MockTaskItf
+{
+    std::string filepath;
+    double speed{ 1.0 }; // multiplier of the captured timing, clamped to [0.1, 100], <=0 means as fast as possible
+    uint16_t serverPort{ 0 }; // tcp replay sends what this port sent on its first connection, 0 means the side answering the first SYN
+};
@@ -0,0 +1,728 @@
+#pragma once
+
+#include "MappedFile.h"
+#include "JournalRecorder.h"
+#include <Logger/Logger.h>
+#include <chrono>
+#include <vector>
+#include <map>
+#include <algorithm>
+#include <string>
+#include <cstring>
+#include <cstdint>
+
+/**
+ * Streaming reader of pcap and pcapng captures, and of JournalRecorder segments, over a memory mapping.
+ * Packets are decoded in place one at a time, the payload views point into the mapping
+ * so a capture of any size starts immediately and only the touched pages become resident.
+ */
+class PcapReader final
+{
+public:
+    enum Protocol : uint8_t
+    {
+        Udp,
+        Tcp
+    };
+
+    enum TcpFlag : uint8_t
+    {
+        Fin = 0x01,
+        Syn = 0x02,
+        Ack = 0x10
+    };
+
+    struct Packet
+    {
+        int64_t time{ 0 }; // capture time in nanoseconds
+        Protocol protocol{ Udp };
+        const uint8_t* data{ nullptr }; // transport payload, points into the mapping
+        size_t size{ 0 };
+        // Zero for journal records, which carry no transport header
+        uint16_t srcPort{ 0 };
+        uint16_t dstPort{ 0 };
+        uint32_t seq{ 0 }; // tcp only
+        uint8_t flags{ 0 }; // tcp only
+    };
+
+public:
+    explicit PcapReader(MappedFilePtr file)
+        : file_(std::move(file))
+    {
+        rewind();
+    }
+
+public:
+    [[nodiscard]] bool isValid() const
+    {
+        return format_ != Unknown;
+    }
+
+    [[nodiscard]] std::string error() const
+    {
+        return err_;
+    }
+
+    // A journal holds the inbound bytes only, in order, there is no flow to pick
+    [[nodiscard]] bool isJournal() const
+    {
+        return format_ == Journal;
+    }
+
+    void rewind()
+    {
+        err_.clear();
+        format_ = Unknown;
+        pos_ = 0;
+        interfaces_.clear();
+        lastTime_ = 0;
+
+        if (file_ == nullptr || file_->size() < 24)
+        {
+            err_ = "Capture file too short";
+            return;
+        }
+        const uint8_t* d = file_->data();
+        if (memcmp(d, JournalRecorder::MAGIC, sizeof(JournalRecorder::MAGIC)) == 0)
+        {
+            format_ = Journal;
+            journalProtocol_ = d[12] == JournalRecorder::Tcp ? Tcp : Udp;
+            pos_ = JournalRecorder::HEADER_LEN;
+            return;
+        }
+        uint32_t magic = read32(d, false);
+        switch (magic)
+        {
+        case 0xA1B2C3D4:
+        case 0xA1B23C4D:
+            swapped_ = false;
+            break;
+        case 0xD4C3B2A1:
+        case 0x4D3CB2A1:
+            swapped_ = true;
+            break;
+        case 0x0A0D0D0A:
+            format_ = PcapNg;
+            return;
+        default:
+            err_ = fmt::format("Unknown capture format, magic={:#x}", magic);
+            return;
+        }
+        format_ = Pcap;
+        magic = read32(d, swapped_);
+        tsScale_ = magic == 0xA1B23C4D ? 1 : 1000;
+        interfaces_.push_back(Interface{ (uint16_t)read32(d + 20, swapped_), 0, 0 });
+        pos_ = 24;
+    }
+
+    // Next UDP packet with a non empty payload or TCP segment with a payload or a SYN, false at the end of the capture
+    bool next(Packet& packet)
+    {
+        if (format_ == Journal)
+        {
+            return nextJournal(packet);
+        }
+        for (;;)
+        {
+            const uint8_t* frame = nullptr;
+            size_t length = 0;
+            uint16_t linkType = 0;
+            bool ok = format_ == Pcap ? nextPcap(frame, length, linkType, packet.time)
+                : format_ == PcapNg ? nextPcapNg(frame, length, linkType, packet.time) : false;
+            if (!ok)
+            {
+                return false;
+            }
+            if (decodeLink(linkType, frame, length, packet))
+            {
+                return true;
+            }
+        }
+    }
+
+private:
+    enum Format : uint8_t
+    {
+        Unknown,
+        Pcap,
+        PcapNg,
+        Journal
+    };
+
+    struct Interface
+    {
+        uint16_t linkType{ 0 };
+        // Timestamp unit is 10^-exponent seconds, or 2^-exponent when binary is set
+        uint8_t exponent{ 6 };
+        bool binary{ false };
+    };
+
+    static uint16_t read16(const uint8_t* p, bool swapped)
+    {
+        uint16_t v;
+        memcpy(&v, p, sizeof(v));
+        return swapped ? (uint16_t)((v >> 8) | (v << 8)) : v;
+    }
+
+    static uint32_t read32(const uint8_t* p, bool swapped)
+    {
+        uint32_t v;
+        memcpy(&v, p, sizeof(v));
+        return swapped ? (v >> 24) | ((v >> 8) & 0xFF00) | ((v << 8) & 0xFF0000) | (v << 24) : v;
+    }
+
+    static uint16_t readBe16(const uint8_t* p)
+    {
+        return (uint16_t)((p[0] << 8) | p[1]);
+    }
+
+    bool nextJournal(Packet& packet)
+    {
+        const uint8_t* d = file_->data();
+        const size_t size = file_->size();
+        if (pos_ + JournalRecorder::RECORD_HEADER_LEN > size)
+        {
+            return false;
+        }
+        uint32_t len = read32(d + pos_, false);
+        if (len == 0 || pos_ + JournalRecorder::RECORD_HEADER_LEN + len > size)
+        {
+            // Zero filled tail of a segment that was not sealed
+            return false;
+        }
+        memcpy(&packet.time, d + pos_ + 8, sizeof(packet.time));
+        packet.protocol = journalProtocol_;
+        packet.srcPort = packet.dstPort = 0;
+        packet.seq = 0;
+        packet.flags = 0;
+        packet.data = d + pos_ + JournalRecorder::RECORD_HEADER_LEN;
+        packet.size = len;
+        pos_ += JournalRecorder::RECORD_HEADER_LEN + len;
+        return true;
+    }
+
+    bool nextPcap(const uint8_t*& frame, size_t& length, uint16_t& linkType, int64_t& time)
+    {
+        const uint8_t* d = file_->data();
+        const size_t size = file_->size();
+        if (pos_ + 16 > size)
+        {
+            return false;
+        }
+        auto sec = read32(d + pos_, swapped_);
+        auto frac = read32(d + pos_ + 4, swapped_);
+        auto caplen = read32(d + pos_ + 8, swapped_);
+        if (pos_ + 16 + caplen > size)
+        {
+            LOG_WARN("Truncated capture record at offset {}", pos_);
+            return false;
+        }
+        time = (int64_t)sec * 1000000000 + (int64_t)frac * tsScale_;
+        frame = d + pos_ + 16;
+        length = caplen;
+        linkType = interfaces_.front().linkType;
+        pos_ += 16 + caplen;
+        return true;
+    }
+
+    bool nextPcapNg(const uint8_t*& frame, size_t& length, uint16_t& linkType, int64_t& time)
+    {
+        const uint8_t* d = file_->data();
+        const size_t size = file_->size();
+        while (pos_ + 12 <= size)
+        {
+            const uint8_t* b = d + pos_;
+            uint32_t type = read32(b, false);
+            if (type == 0x0A0D0D0A)
+            {
+                // Section header, palindromic type, byte order is told by the magic that follows
+                swapped_ = read32(b + 8, false) == 0x4D3C2B1A;
+                interfaces_.clear();
+            }
+            else
+            {
+                type = read32(b, swapped_);
+            }
+            uint32_t total = read32(b + 4, swapped_);
+            if (total < 12 || total % 4 != 0 || pos_ + total > size)
+            {
+                LOG_WARN("Truncated capture block at offset {}", pos_);
+                return false;
+            }
+            pos_ += total;
+
+            switch (type)
+            {
+            case 1: // interface description
+                if (total >= 20)
+                {
+                    interfaces_.push_back(parseInterface(b, total));
+                }
+                break;
+            case 6: // enhanced packet
+            case 2: // obsolete packet
+            {
+                if (total < 32)
+                {
+                    break;
+                }
+                uint32_t id = type == 6 ? read32(b + 8, swapped_) : read16(b + 8, swapped_);
+                if (id >= interfaces_.size())
+                {
+                    break;
+                }
+                uint64_t ts = ((uint64_t)read32(b + 12, swapped_) << 32) | read32(b + 16, swapped_);
+                uint32_t caplen = read32(b + 20, swapped_);
+                if ((uint64_t)caplen + 32 > total)
+                {
+                    break;
+                }
+                const auto& itf = interfaces_[id];
+                time = lastTime_ = toNanoseconds(ts, itf);
+                frame = b + 28;
+                length = caplen;
+                linkType = itf.linkType;
+                return true;
+            }
+            case 3: // simple packet, no timestamp, belongs to the first interface
+            {
+                if (interfaces_.empty() || total < 16)
+                {
+                    break;
+                }
+                uint32_t len = read32(b + 8, swapped_);
+                time = lastTime_;
+                frame = b + 12;
+                length = std::min<size_t>(len, total - 16);
+                linkType = interfaces_.front().linkType;
+                return true;
+            }
+            default:
+                break;
+            }
+        }
+        return false;
+    }
+
+    Interface parseInterface(const uint8_t* b, uint32_t total) const
+    {
+        Interface itf;
+        itf.linkType = read16(b + 8, swapped_);
+        for (size_t off = 16; off + 4 <= total - 4;)
+        {
+            uint16_t code = read16(b + off, swapped_);
+            uint16_t len = read16(b + off + 2, swapped_);
+            if (code == 0)
+            {
+                break;
+            }
+            if (code == 9 && len >= 1)
+            {
+                uint8_t v = b[off + 4];
+                itf.binary = (v & 0x80) != 0;
+                itf.exponent = v & 0x7F;
+            }
+            off += 4 + ((len + 3) & ~3u);
+        }
+        return itf;
+    }
+
+    static int64_t toNanoseconds(uint64_t ts, const Interface& itf)
+    {
+        if (itf.binary)
+        {
+            return (int64_t)((long double)ts * 1e9L / (long double)(1ULL << std::min<uint8_t>(itf.exponent, 63)));
+        }
+        int64_t scale = 1;
+        if (itf.exponent <= 9)
+        {
+            for (int i = itf.exponent; i < 9; ++i)
+            {
+                scale *= 10;
+            }
+            return (int64_t)ts * scale;
+        }
+        for (int i = 9; i < itf.exponent && i < 27; ++i)
+        {
+            scale *= 10;
+        }
+        return (int64_t)(ts / scale);
+    }
+
+    static bool decodeLink(uint16_t linkType, const uint8_t* p, size_t len, Packet& packet)
+    {
+        uint16_t etherType = 0;
+        switch (linkType)
+        {
+        case 1: // ethernet
+        {
+            if (len < 14)
+            {
+                return false;
+            }
+            etherType = readBe16(p + 12);
+            size_t off = 14;
+            while ((etherType == 0x8100 || etherType == 0x88A8) && len >= off + 4)
+            {
+                etherType = readBe16(p + off + 2);
+                off += 4;
+            }
+            p += off;
+            len -= off;
+            break;
+        }
+        case 0: // bsd loopback, address family in host order of the capturing machine
+        {
+            if (len < 4)
+            {
+                return false;
+            }
+            uint32_t family = p[0] | p[1] | p[2] | p[3];
+            etherType = family == 2 ? 0x0800 : 0x86DD;
+            p += 4;
+            len -= 4;
+            break;
+        }
+        case 113: // linux cooked
+            if (len < 16)
+            {
+                return false;
+            }
+            etherType = readBe16(p + 14);
+            p += 16;
+            len -= 16;
+            break;
+        case 276: // linux cooked v2
+            if (len < 20)
+            {
+                return false;
+            }
+            etherType = readBe16(p);
+            p += 20;
+            len -= 20;
+            break;
+        case 12:
+        case 101: // raw ip, version told by the first nibble
+            if (len < 1)
+            {
+                return false;
+            }
+            etherType = (p[0] >> 4) == 6 ? 0x86DD : 0x0800;
+            break;
+        case 228:
+            etherType = 0x0800;
+            break;
+        case 229:
+            etherType = 0x86DD;
+            break;
+        default:
+            return false;
+        }
+
+        if (etherType == 0x0800)
+        {
+            return decodeIpv4(p, len, packet);
+        }
+        if (etherType == 0x86DD)
+        {
+            return decodeIpv6(p, len, packet);
+        }
+        return false;
+    }
+
+    static bool decodeIpv4(const uint8_t* p, size_t len, Packet& packet)
+    {
+        if (len < 20 || (p[0] >> 4) != 4)
+        {
+            return false;
+        }
+        size_t ihl = (p[0] & 0x0F) * 4;
+        size_t total = readBe16(p + 2);
+        // Fragments carry partial transport payloads, they are not replayable alone
+        if (ihl < 20 || (readBe16(p + 6) & 0x3FFF) != 0)
+        {
+            return false;
+        }
+        // Drop link layer padding, keep what was actually captured
+        len = std::min(len, total);
+        if (len < ihl)
+        {
+            return false;
+        }
+        return decodeTransport(p[9], p + ihl, len - ihl, packet);
+    }
+
+    static bool decodeIpv6(const uint8_t* p, size_t len, Packet& packet)
+    {
+        if (len < 40 || (p[0] >> 4) != 6)
+        {
+            return false;
+        }
+        len = std::min(len, (size_t)readBe16(p + 4) + 40);
+        uint8_t next = p[6];
+        size_t off = 40;
+        while (next == 0 || next == 43 || next == 60)
+        {
+            if (len < off + 8)
+            {
+                return false;
+            }
+            next = p[off];
+            off += (p[off + 1] + 1) * 8;
+        }
+        if (next == 44 || len < off)
+        {
+            return false;
+        }
+        return decodeTransport(next, p + off, len - off, packet);
+    }
+
+    static bool decodeTransport(uint8_t protocol, const uint8_t* p, size_t len, Packet& packet)
+    {
+        size_t header = 0;
+        if (protocol == 17)
+        {
+            if (len < 8)
+            {
+                return false;
+            }
+            header = 8;
+            len = std::min(len, (size_t)readBe16(p + 4));
+            packet.protocol = Udp;
+            packet.seq = 0;
+            packet.flags = 0;
+        }
+        else if (protocol == 6)
+        {
+            if (len < 20)
+            {
+                return false;
+            }
+            header = (p[12] >> 4) * 4;
+            // A data offset below the fixed header would count header bytes as payload
+            if (header < 20 || header > len)
+            {
+                return false;
+            }
+            packet.protocol = Tcp;
+            packet.seq = ((uint32_t)readBe16(p + 4) << 16) | readBe16(p + 6);
+            packet.flags = p[13];
+        }
+        else
+        {
+            return false;
+        }
+        packet.srcPort = readBe16(p);
+        packet.dstPort = readBe16(p + 2);
+        // A SYN without payload still tells the side and the first sequence number of a connection
+        if (len <= header && !(packet.protocol == Tcp && (packet.flags & Syn) != 0))
+        {
+            return false;
+        }
+        packet.data = p + header;
+        packet.size = len - header;
+        return true;
+    }
+
+private:
+    MappedFilePtr file_;
+    Format format_{ Unknown };
+    Protocol journalProtocol_{ Tcp };
+    bool swapped_{ false };
+    int64_t tsScale_{ 1000 };
+    size_t pos_{ 0 };
+    std::vector<Interface> interfaces_;
+    int64_t lastTime_{ 0 };
+    std::string err_;
+};
+
+
+// The byte stream one side of a captured TCP connection sent: one flow and direction, in sequence order without repeats
+class PcapTcpStream final
+{
+public:
+    struct Flow
+    {
+        uint16_t serverPort{ 0 };
+        uint16_t clientPort{ 0 };
+        uint32_t base{ 0 }; // sequence number of the first byte
+        bool journal{ false };
+    };
+
+public:
+    // serverPort 0 picks the side that answered the first SYN, otherwise the first connection that port sent on
+    static bool find(PcapReader& reader, uint16_t serverPort, Flow& flow)
+    {
+        flow = Flow();
+        if (reader.isJournal())
+        {
+            flow.journal = true;
+            return true;
+        }
+        PcapReader::Packet packet;
+        bool found = false;
+        while (!found && reader.next(packet))
+        {
+            if (packet.protocol != PcapReader::Tcp || (serverPort != 0 && packet.srcPort != serverPort))
+            {
+                continue;
+            }
+            const bool synAck = (packet.flags & (PcapReader::Syn | PcapReader::Ack)) == (PcapReader::Syn | PcapReader::Ack);
+            if (synAck || (serverPort != 0 && (packet.flags & PcapReader::Syn) == 0 && packet.size > 0))
+            {
+                flow.serverPort = packet.srcPort;
+                flow.clientPort = packet.dstPort;
+                // The SYN takes one sequence number
+                flow.base = synAck ? packet.seq + 1 : packet.seq;
+                found = true;
+            }
+        }
+        reader.rewind();
+        return found;
+    }
+
+public:
+    explicit PcapTcpStream(const Flow& flow)
+        : flow_(flow)
+    {
+
+    }
+
+public:
+    // Starts the stream over for another pass of the capture
+    void restart()
+    {
+        next_ = 0;
+        held_.clear();
+    }
+
+    // Emits (data, size) for the bytes of the packet that are next in the stream, and for any held segment they complete.
+    // A segment after a gap is held until the gap is filled, repeats and overlaps are trimmed
+    template<typename Func>
+    void push(const PcapReader::Packet& packet, const Func& emit)
+    {
+        if (flow_.journal)
+        {
+            return emit(packet.data, packet.size);
+        }
+        if (packet.protocol != PcapReader::Tcp || packet.srcPort != flow_.serverPort || packet.dstPort != flow_.clientPort
+            || (packet.flags & PcapReader::Syn) != 0 || packet.size == 0)
+        {
+            return;
+        }
+        // Offsets wrap like sequence numbers, a flow is compared within 2 GiB of its next byte
+        uint32_t offset = packet.seq - flow_.base;
+        if ((int32_t)(offset - next_) > 0 && held_.size() >= MAX_HELD)
+        {
+            // The missing bytes were most likely never captured
+            skipGap(emit);
+        }
+        if ((int32_t)(offset - next_) > 0)
+        {
+            auto& held = held_[offset];
+            if (packet.size > held.second)
+            {
+                held = { packet.data, packet.size };
+            }
+            return;
+        }
+        append(offset, packet.data, packet.size, emit);
+        drain(emit);
+    }
+
+    // End of the capture, sends what is still held behind gaps that were never filled
+    template<typename Func>
+    void finish(const Func& emit)
+    {
+        while (!held_.empty())
+        {
+            skipGap(emit);
+        }
+    }
+
+private:
+    static constexpr size_t MAX_HELD = 4096;
+
+    template<typename Func>
+    void skipGap(const Func& emit)
+    {
+        LOG_DEBUG("Tcp stream gap skipped, port={}, offset={}, bytes={}", flow_.serverPort, next_, held_.begin()->first - next_);
+        next_ = held_.begin()->first;
+        drain(emit);
+    }
+
+    template<typename Func>
+    void append(uint32_t offset, const uint8_t* data, size_t size, const Func& emit)
+    {
+        auto behind = (size_t)(next_ - offset);
+        if (behind >= size)
+        {
+            return;
+        }
+        emit(data + behind, size - behind);
+        next_ += (uint32_t)(size - behind);
+    }
+
+    template<typename Func>
+    void drain(const Func& emit)
+    {
+        while (!held_.empty() && (int32_t)(held_.begin()->first - next_) <= 0)
+        {
+            auto it = held_.begin();
+            append(it->first, it->second.first, it->second.second, emit);
+            held_.erase(it);
+        }
+    }
+
+private:
+    Flow flow_;
+    uint32_t next_{ 0 };
+    // Segments past a gap by offset, views into the mapping
+    std::map<uint32_t, std::pair<const uint8_t*, size_t>> held_;
+};
+
+
+// Maps capture timestamps to steady clock deadlines for a replay speed, the first packet is due at once
+class PcapReplayClock final
+{
+public:
+    using Clock = std::chrono::steady_clock;
+
+public:
+    explicit PcapReplayClock(double speed)
+        : speed_(speed <= 0 ? 0 : std::clamp(speed, 0.1, 100.0))
+    {
+
+    }
+
+public:
+    // false means as fast as possible
+    [[nodiscard]] bool isPaced() const
+    {
+        return speed_ > 0;
+    }
+
+    void restart()
+    {
+        started_ = false;
+    }
+
+    Clock::time_point due(int64_t captureTime)
+    {
+        if (!started_)
+        {
+            started_ = true;
+            origin_ = captureTime;
+            start_ = Clock::now();
+        }
+        // Out of order timestamps are sent right away rather than waiting in the past
+        auto offset = std::max<int64_t>(captureTime - origin_, 0);
+        return start_ + std::chrono::nanoseconds((int64_t)(offset / speed_));
+    }
+
+private:
+    double speed_{ 1.0 };
+    bool started_{ false };
+    int64_t origin_{ 0 };
+    Clock::time_point start_;
+};
@@ -0,0 +1,164 @@
+#pragma once
+
+#include <atomic>
+#include <chrono>
+#include <thread>
+#include <algorithm>
+#include <cstdint>
+
+#if defined(__x86_64__) || defined(_M_X64) || defined(__i386__) || defined(_M_IX86)
+#include <immintrin.h>
+#define RATE_PACER_RELAX() _mm_pause()
+#else
+#define RATE_PACER_RELAX() std::this_thread::yield()
+#endif
+
+/**
+ * Token bucket pacer for packets per second and bytes per second at the same time.
+ * The bucket is kept as the theoretical send time of the next packet, so a packet costs
+ * max(1/pps, bytes/bps) and up to burst packets may be sent back to back after a stall.
+ * Waiting sleeps while the deadline is far away and spins for the last spinThreshold,
+ * which keeps microsecond gaps stable where the OS sleep granularity would not.
+ * Sleeps are cut into slices of at most MAX_SLEEP, a wait is interrupted within one slice.
+ * Stats count what the caller commits after a send, not what was scheduled, so they show the achieved rate.
+ */
+class RatePacer final
+{
+public:
+    using Clock = std::chrono::steady_clock;
+
+    static constexpr auto MAX_SLEEP = std::chrono::milliseconds(10);
+
+    struct Stats
+    {
+        uint64_t packets{ 0 };
+        uint64_t bytes{ 0 };
+        double seconds{ 0 };
+        double pps{ 0 };
+        double bps{ 0 };
+        double targetPps{ 0 };
+        double targetBps{ 0 };
+    };
+
+public:
+    // pps or bps <= 0 means unlimited for that dimension
+    explicit RatePacer(double pps = 0, double bps = 0, uint32_t burst = 1, std::chrono::nanoseconds spinThreshold = std::chrono::microseconds(100))
+        : pps_(pps)
+        , bps_(bps)
+        , burst_(std::max<uint32_t>(burst, 1))
+        , spinThreshold_(spinThreshold)
+    {
+        reset();
+    }
+
+public:
+    void reset()
+    {
+        start_ = Clock::now();
+        next_ = start_;
+        packets_ = 0;
+        bytes_ = 0;
+    }
+
+    [[nodiscard]] bool isLimited() const
+    {
+        return pps_ > 0 || bps_ > 0;
+    }
+
+    // Block until a packet of the given size may be sent
+    void acquire(size_t bytes)
+    {
+        acquire(1, bytes);
+    }
+
+    // Block until a batch of packets may be sent, the batch leaves as one burst, commit it once sent
+    void acquire(size_t packets, size_t bytes)
+    {
+        waitUntil(schedule(packets, bytes));
+    }
+
+    // Reserve the send time of a batch without waiting, for callers driven by a timer
+    Clock::time_point schedule(size_t packets, size_t bytes)
+    {
+        if (!isLimited())
+        {
+            return Clock::time_point();
+        }
+
+        auto cost = std::chrono::nanoseconds(0);
+        if (pps_ > 0)
+        {
+            cost = std::max(cost, std::chrono::nanoseconds((int64_t)(1e9 * packets / pps_)));
+        }
+        if (bps_ > 0)
+        {
+            cost = std::max(cost, std::chrono::nanoseconds((int64_t)(1e9 * bytes / bps_)));
+        }
+
+        auto now = Clock::now();
+        // Credit never exceeds the bucket depth, a long stall must not turn into a flood
+        next_ = std::max(next_, now - cost * (burst_ - 1));
+        auto due = next_;
+        next_ += cost;
+        return due;
+    }
+
+    // Count what actually left, a failed or partial send must not inflate the achieved rate
+    void commit(size_t packets, size_t bytes)
+    {
+        packets_ += packets;
+        bytes_ += bytes;
+    }
+
+    // Sleep while the deadline is far away, spin for the last spinThreshold
+    void waitUntil(Clock::time_point deadline) const
+    {
+        static const std::atomic<bool> never{ false };
+        waitUntil(deadline, never);
+    }
+
+    // Same, false once interrupted is set, a low rate or a long capture gap must not hold up a stop
+    bool waitUntil(Clock::time_point deadline, const std::atomic<bool>& interrupted) const
+    {
+        for (auto remain = deadline - Clock::now(); remain > spinThreshold_; remain = deadline - Clock::now())
+        {
+            if (interrupted)
+            {
+                return false;
+            }
+            std::this_thread::sleep_for(std::min<Clock::duration>(remain - spinThreshold_, MAX_SLEEP));
+        }
+        while (Clock::now() < deadline)
+        {
+            if (interrupted)
+            {
+                return false;
+            }
+            RATE_PACER_RELAX();
+        }
+        return !interrupted;
+    }
+
+    [[nodiscard]] Stats stats() const
+    {
+        Stats s;
+        s.packets = packets_;
+        s.bytes = bytes_;
+        s.seconds = std::chrono::duration<double>(Clock::now() - start_).count();
+        s.pps = s.seconds > 0 ? packets_ / s.seconds : 0;
+        s.bps = s.seconds > 0 ? bytes_ / s.seconds : 0;
+        s.targetPps = pps_;
+        s.targetBps = bps_;
+        return s;
+    }
+
+private:
+    double pps_{ 0 };
+    double bps_{ 0 };
+    uint32_t burst_{ 1 };
+    std::chrono::nanoseconds spinThreshold_;
+    Clock::time_point start_;
+    Clock::time_point next_;
+    uint64_t packets_{ 0 };
+    uint64_t bytes_{ 0 };
+};
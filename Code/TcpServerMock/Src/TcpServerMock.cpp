@@ -1,6 +1,306 @@
 #include "TcpServerMock.h"
+#include <Logger/Logger.h>
+#include <boost/asio/write.hpp>
+#include <boost/asio/post.hpp>
+#include <boost/asio/steady_timer.hpp>
+#include <future>
+#include <chrono>
+#include <cstring>
+#include <array>
 #include <cassert>
 
+#ifdef __linux__
+#include <sys/sendfile.h>
+#include <cerrno>
+#endif
+
+class TcpMockSession : public std::enable_shared_from_this<TcpMockSession>
+{
+    static const size_t READ_BUFFER_LEN = 1024;
+    static const size_t REPLAY_GATHER_MAX = 64;
+
+public:
+    TcpMockSession(TcpServerMock& server, boost::asio::ip::tcp::socket socket, size_t index, int loopCount)
+        : server_(server)
+        , pool_(*server.pool_)
+        , index_(index)
+        , socket_(std::move(socket))
+        , payload_(server.payload_)
+        , file_(server.file_)
+        , timer_(socket_.get_executor())
+        , id_(++server.sessionId_)
+        , loopCount_(loopCount)
+    {
+        server_.sessionCount_ += 1;
+        if (server_.task_->type == MockTaskItf::Pcap)
+        {
+            // Every session walks the shared mapping with its own cursor and clock
+            reader_ = std::make_unique<PcapReader>(file_);
+            clock_ = std::make_unique<PcapReplayClock>(std::static_pointer_cast<PcapMockTask>(server_.task_)->speed);
+            stream_ = std::make_unique<PcapTcpStream>(server_.flow_);
+        }
+    }
+
+    ~TcpMockSession()
+    {
+        {
+            std::lock_guard<std::mutex> lock(server_.mutex_);
+            server_.sessions_.erase(id_);
+        }
+        pool_.release(index_);
+        server_.sessionCount_ -= 1;
+    }
+
+    [[nodiscard]] uint32_t id() const
+    {
+        return id_;
+    }
+
+public:
+    // Start on the io_context owning the socket, the session is never touched by another thread
+    void post()
+    {
+        boost::asio::post(socket_.get_executor(), [self = shared_from_this()]
+        {
+            boost::system::error_code ignored;
+            self->socket_.native_non_blocking(true, ignored);
+            self->doRead();
+            self->doWrite();
+        });
+    }
+
+    // Called from any thread, pending operations complete with operation_aborted and release the session
+    void cancel()
+    {
+        boost::asio::post(socket_.get_executor(), [self = shared_from_this()]
+        {
+            self->timer_.cancel();
+            self->close();
+        });
+    }
+
+private:
+    void doWrite()
+    {
+        if (server_.interrupted_ || (loopCount_ > 0 && sent_ >= loopCount_))
+        {
+            return shutdown();
+        }
+        if (reader_ != nullptr)
+        {
+            return doReplay();
+        }
+#ifdef __linux__
+        if (file_ != nullptr)
+        {
+            return doSendFile();
+        }
+#endif
+        auto buffer = file_ != nullptr ? boost::asio::buffer(file_->data(), file_->size()) : payload_.buffer();
+        boost::asio::async_write(socket_, buffer, [self = shared_from_this()](boost::system::error_code ec, size_t)
+        {
+            if (ec)
+            {
+                LOG_DEBUG("Send failed, {}", ec.message());
+                return self->close();
+            }
+            self->onSent();
+        });
+    }
+
+#ifdef __linux__
+    // Copy the mapped file from page cache to the socket inside the kernel, resume on EAGAIN
+    void doSendFile()
+    {
+        socket_.async_wait(boost::asio::ip::tcp::socket::wait_write, [self = shared_from_this()](boost::system::error_code ec)
+        {
+            if (ec)
+            {
+                return self->close();
+            }
+            const auto size = (off_t)self->file_->size();
+            while (self->offset_ < size)
+            {
+                auto n = ::sendfile(self->socket_.native_handle(), self->file_->handle(), &self->offset_, size - self->offset_);
+                if (n > 0)
+                {
+                    continue;
+                }
+                if (n < 0 && errno == EINTR)
+                {
+                    continue;
+                }
+                if (n < 0 && (errno == EAGAIN || errno == EWOULDBLOCK))
+                {
+                    return self->doSendFile();
+                }
+                LOG_DEBUG("Send file failed, path={}, err={}", self->file_->path(), n < 0 ? strerror(errno) : "truncated");
+                return self->close();
+            }
+            self->offset_ = 0;
+            self->onSent();
+        });
+    }
+#endif
+
+    // Writes the stream bytes of the segments already due in one gather write, or sleeps until the next one is due
+    void doReplay()
+    {
+        gather_.clear();
+        auto emit = [this](const uint8_t* data, size_t size)
+        {
+            gather_.emplace_back(data, size);
+            replayed_ += 1;
+        };
+        auto now = PcapReplayClock::Clock::now();
+        auto due = now;
+        while (gather_.size() < REPLAY_GATHER_MAX)
+        {
+            if (!pending_)
+            {
+                pending_ = reader_->next(packet_);
+                if (!pending_)
+                {
+                    // Segments held behind a gap the capture never filled
+                    stream_->finish(emit);
+                    break;
+                }
+                if (packet_.protocol != PcapReader::Tcp)
+                {
+                    pending_ = false;
+                    continue;
+                }
+            }
+            if (clock_->isPaced())
+            {
+                due = clock_->due(packet_.time);
+                if (due > now)
+                {
+                    break;
+                }
+            }
+            stream_->push(packet_, emit);
+            pending_ = false;
+        }
+
+        if (!gather_.empty())
+        {
+            boost::asio::async_write(socket_, gather_, [self = shared_from_this()](boost::system::error_code ec, size_t)
+            {
+                if (ec)
+                {
+                    LOG_DEBUG("Send failed, {}", ec.message());
+                    return self->close();
+                }
+                self->doReplay();
+            });
+            return;
+        }
+        if (pending_)
+        {
+            timer_.expires_at(due);
+            timer_.async_wait([self = shared_from_this()](boost::system::error_code ec)
+            {
+                if (!ec)
+                {
+                    self->doReplay();
+                }
+            });
+            return;
+        }
+
+        // End of the capture, a capture without any TCP payload must not spin forever
+        if (replayed_ == 0)
+        {
+            LOG_WARN("No tcp payload in capture, path={}", file_->path());
+            return shutdown();
+        }
+        replayed_ = 0;
+        reader_->rewind();
+        clock_->restart();
+        stream_->restart();
+        onSent();
+    }
+
+    void onSent()
+    {
+        sent_ += 1;
+        if (server_.outFunc_ != nullptr && file_ == nullptr)
+        {
+            server_.outFunc_(payload_);
+        }
+        doWrite();
+    }
+
+    void doRead()
+    {
+        socket_.async_read_some(boost::asio::buffer(buffer_), [self = shared_from_this()](boost::system::error_code ec, size_t length)
+        {
+            if (ec)
+            {
+                return;
+            }
+            if (self->server_.recorder_ != nullptr)
+            {
+                self->server_.recorder_->append(self->id_, self->buffer_.data(), length);
+            }
+            if (self->server_.inFunc_ != nullptr)
+            {
+                self->server_.inFunc_(Message(self->buffer_.data(), length));
+            }
+            self->doRead();
+        });
+    }
+
+    void shutdown()
+    {
+        boost::system::error_code ignored;
+        socket_.shutdown(boost::asio::ip::tcp::socket::shutdown_send, ignored);
+    }
+
+    void close()
+    {
+        boost::system::error_code ignored;
+        socket_.close(ignored);
+    }
+
+private:
+    TcpServerMock& server_;
+    // Not the server's pointer, it is already reset when a stopped pool destroys pending handlers
+    IoContextPool& pool_;
+    size_t index_{ 0 };
+    boost::asio::ip::tcp::socket socket_;
+    TcpServerMock::Payload payload_;
+    MappedFilePtr file_;
+    std::unique_ptr<PcapReader> reader_;
+    std::unique_ptr<PcapReplayClock> clock_;
+    std::unique_ptr<PcapTcpStream> stream_;
+    PcapReader::Packet packet_;
+    bool pending_{ false };
+    size_t replayed_{ 0 };
+    std::vector<boost::asio::const_buffer> gather_;
+    boost::asio::steady_timer timer_;
+    uint32_t id_{ 0 };
+#ifdef __linux__
+    off_t offset_{ 0 };
+#endif
+    int loopCount_{ 0 };
+    int sent_{ 0 };
+    std::array<uint8_t, READ_BUFFER_LEN> buffer_{};
+};
+
+
+TcpServerMock::TcpServerMock(size_t threadCount)
+    : threadCount_(threadCount)
+{
+
+}
+
+TcpServerMock::~TcpServerMock()
+{
+    stop();
+}
+
 bool TcpServerMock::init(MockTaskPtr task, MessageHandler inHandler, MessageHandler outHandler)
 {
     task_ = task;
@@ -9,7 +309,7 @@ bool TcpServerMock::init(MockTaskPtr task, MessageHandler inHandler, MessageHand
     return true;
 }
 
-void TcpServerMock::start()
+bool TcpServerMock::start()
 {
     switch (task_->type)
     {
@@ -17,6 +317,8 @@ void TcpServerMock::start()
         return startServer(std::static_pointer_cast<FileMockTask>(task_));
     case MockTaskItf::Text:
         return startServer(std::static_pointer_cast<TextMockTask>(task_));
+    case MockTaskItf::Pcap:
+        return startServer(std::static_pointer_cast<PcapMockTask>(task_));
     default:
         throw std::logic_error("Not implemented");
     }
@@ -25,15 +327,235 @@ void TcpServerMock::start()
 void TcpServerMock::stop()
 {
     interrupted_ = true;
+    if (acceptor_ != nullptr && pool_ != nullptr && !closeAll())
+    {
+        LOG_ERROR("Stop gave up, handlers of the shared pool may still refer to the mock, address={}:{}, sessions={}",
+            task_->ip, task_->port, sessionCount_.load());
+    }
+    reset();
+}
+
+bool TcpServerMock::closeAll()
+{
+    static constexpr auto STOP_TIMEOUT = std::chrono::seconds(3);
+    static constexpr auto STOP_GIVE_UP = std::chrono::seconds(30);
+    const auto start = std::chrono::steady_clock::now();
+    auto deadline = start + STOP_TIMEOUT;
+    bool failed = false;
+    // Handlers left on a running shared pool still hold this mock, they are waited for up to the give up time.
+    // A stopped shared pool never runs them again. An owned pool is given up on at the first timeout,
+    // reset stops it and its pending handlers are destroyed before this mock
+    auto overdue = [&](const char* what)
+    {
+        if (!ownsPool_ && !pool_->isRunning())
+        {
+            LOG_WARN("{} skipped, the shared pool is stopped, address={}:{}", what, task_->ip, task_->port);
+            return true;
+        }
+        auto now = std::chrono::steady_clock::now();
+        if (now < deadline)
+        {
+            return false;
+        }
+        LOG_WARN("{} timeout, address={}:{}, sessions={}", what, task_->ip, task_->port, sessionCount_.load());
+        deadline += STOP_TIMEOUT;
+        failed = !ownsPool_ && now - start >= STOP_GIVE_UP;
+        return ownsPool_ || failed;
+    };
+
+    // The marker is queued behind the aborted accept handler, once set the acceptor is no longer used
+    auto closed = std::make_shared<std::promise<void>>();
+    auto executor = acceptor_->get_executor();
+    boost::asio::post(executor, [this, executor, closed]
+    {
+        boost::system::error_code ignored;
+        acceptor_->close(ignored);
+        boost::asio::post(executor, [closed]
+        {
+            closed->set_value();
+        });
+    });
+    auto future = closed->get_future();
+    while (!overdue("Close acceptor"))
+    {
+        if (future.wait_until(deadline) == std::future_status::ready)
+        {
+            break;
+        }
+    }
+    if (failed)
+    {
+        return false;
+    }
+
+    {
+        std::lock_guard<std::mutex> lock(mutex_);
+        for (const auto& it : sessions_)
+        {
+            if (auto session = it.second.lock())
+            {
+                session->cancel();
+            }
+        }
+    }
+    while (sessionCount_ > 0 && !overdue("Close sessions"))
+    {
+        std::this_thread::sleep_for(std::chrono::milliseconds(1));
+    }
+    return !failed;
 }
 
-void TcpServerMock::startServer(const std::shared_ptr<FileMockTask>& task)
+void TcpServerMock::reset()
+{
+    if (ownsPool_ && pool_ != nullptr)
+    {
+        pool_->stop();
+    }
+    acceptor_.reset();
+    if (pool_ != nullptr)
+    {
+        pool_->release(acceptorIndex_);
+    }
+    pool_.reset();
+    ownsPool_ = false;
+    payload_ = Payload();
+    file_.reset();
+}
+
+bool TcpServerMock::startServer(const std::shared_ptr<FileMockTask>& task)
+{
+    assert(task!= nullptr);
+    auto file = std::make_shared<MappedFile>();
+    if (!file->open(task->filepath))
+    {
+        return false;
+    }
+    return startServer(Payload(), std::move(file));
+}
+
+bool TcpServerMock::startServer(const std::shared_ptr<TextMockTask>& task)
 {
     assert(task!= nullptr);
+    return startServer(Payload(task->text), nullptr);
 }
 
-void TcpServerMock::startServer(const std::shared_ptr<TextMockTask>& task)
+bool TcpServerMock::startServer(const std::shared_ptr<PcapMockTask>& task)
 {
     assert(task!= nullptr);
+    auto file = std::make_shared<MappedFile>();
+    if (!file->open(task->filepath))
+    {
+        return false;
+    }
+    PcapReader reader(file);
+    if (!reader.isValid())
+    {
+        LOG_ERROR("Invalid capture file, path={}, err={}", task->filepath, reader.error());
+        return false;
+    }
+    // The client gets the byte stream of one side of one connection, not every payload in the capture
+    if (!PcapTcpStream::find(reader, task->serverPort, flow_))
+    {
+        LOG_ERROR("No tcp connection to replay in capture, path={}, server port={}", task->filepath, task->serverPort);
+        return false;
+    }
+    if (!flow_.journal)
+    {
+        LOG_INFO("Replaying tcp flow, path={}, server port={}, client port={}", task->filepath, flow_.serverPort, flow_.clientPort);
+    }
+    return startServer(Payload(), std::move(file));
+}
+
+bool TcpServerMock::startServer(Payload payload, MappedFilePtr file)
+{
+    if (pool_ != nullptr)
+    {
+        LOG_WARN("Duplicate start, address={}:{}", task_->ip, task_->port);
+        return false;
+    }
+    auto size = file != nullptr ? file->size() : payload.size();
+    if (size == 0)
+    {
+        LOG_WARN("Empty payload, address={}:{}", task_->ip, task_->port);
+    }
 
+    using tcp = boost::asio::ip::tcp;
+    interrupted_ = false;
+    payload_ = std::move(payload);
+    file_ = std::move(file);
+    ownsPool_ = sharedPool_ == nullptr;
+    pool_ = ownsPool_ ? std::make_shared<IoContextPool>(threadCount_) : sharedPool_;
+    acceptorIndex_ = pool_->acquire();
+
+    boost::system::error_code ec;
+    tcp::endpoint ep(boost::asio::ip::make_address(task_->ip, ec), (uint16_t)task_->port);
+    if (ec)
+    {
+        LOG_ERROR("Invalid address, ip={}, err={}", task_->ip, ec.message());
+        reset();
+        return false;
+    }
+    acceptor_ = std::make_unique<tcp::acceptor>(pool_->at(acceptorIndex_));
+    acceptor_->open(ep.protocol(), ec);
+    if (!ec)
+    {
+        acceptor_->set_option(tcp::acceptor::reuse_address(true), ec);
+    }
+    if (!ec)
+    {
+        acceptor_->bind(ep, ec);
+    }
+    if (!ec)
+    {
+        acceptor_->listen(boost::asio::socket_base::max_listen_connections, ec);
+    }
+    if (ec)
+    {
+        LOG_ERROR("Listen failed, address={}:{}, err={}", task_->ip, task_->port, ec.message());
+        reset();
+        return false;
+    }
+
+    LOG_INFO("Tcp server mock started, address={}:{}, threads={}, shared={}, payload size={}", task_->ip, task_->port, pool_->size(), !ownsPool_, size);
+    boost::asio::post(acceptor_->get_executor(), [this]
+    {
+        doAccept();
+    });
+    if (ownsPool_)
+    {
+        pool_->run();
+    }
+    return true;
 }
+
+void TcpServerMock::doAccept()
+{
+    // Sockets are accepted directly onto the least loaded io_context of the pool
+    auto index = pool_->acquire();
+    acceptor_->async_accept(pool_->at(index), [this, index](boost::system::error_code ec, boost::asio::ip::tcp::socket socket)
+    {
+        if (ec)
+        {
+            pool_->release(index);
+            if (ec != boost::asio::error::operation_aborted)
+            {
+                LOG_ERROR("Accept failed, {}", ec.message());
+            }
+            if (interrupted_ || !acceptor_->is_open())
+            {
+                return;
+            }
+            return doAccept();
+        }
+        socket.set_option(boost::asio::ip::tcp::no_delay(true), ec);
+        auto session = std::make_shared<TcpMockSession>(*this, std::move(socket), index, task_->loopCount);
+        {
+            std::lock_guard<std::mutex> lock(mutex_);
+            sessions_.emplace(session->id(), session);
+        }
+        session->post();
+        doAccept();
+    });
+}
+
+DECLEAR_MOCK(TcpServerMock)
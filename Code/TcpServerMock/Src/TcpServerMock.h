@@ -1,28 +1,69 @@
 #pragma once
 
 #include "MockItf.h"
-#include <Asula/TcpClientSync.hpp>
+#include "IoContextPool.h"
+#include "MappedFile.h"
+#include "PcapReader.h"
+#include <boost/asio/ip/tcp.hpp>
+#include <memory>
+#include <unordered_map>
+#include <mutex>
 #include <atomic>
 
+class TcpMockSession;
+
 class TcpServerMock : public MockItf
 {
 public:
-    ~TcpServerMock() override = default;
+    // All sessions stream from the same encoded payload, never copied per connection
+    using Payload = Message;
+
+public:
+    // threadCount is ignored when running on a pool set by setIoContextPool
+    explicit TcpServerMock(size_t threadCount = std::thread::hardware_concurrency());
+    ~TcpServerMock() override;
 
 public:
     bool init(MockTaskPtr task, MessageHandler inHandler, MessageHandler outHandler) override;
-    void start() override;
+    bool start() override;
     void stop() override;
 
+    [[nodiscard]] size_t sessionCount() const
+    {
+        return sessionCount_;
+    }
+
 private:
-    void startServer(const std::shared_ptr<FileMockTask>&);
-    void startServer(const std::shared_ptr<TextMockTask>&);
+    bool startServer(const std::shared_ptr<FileMockTask>&);
+    bool startServer(const std::shared_ptr<TextMockTask>&);
+    bool startServer(const std::shared_ptr<PcapMockTask>&);
+    bool startServer(Payload payload, MappedFilePtr file);
+    void doAccept();
+    // False when handlers of a shared pool were given up on while still running
+    bool closeAll();
+    void reset();
 
 private:
+    friend class TcpMockSession;
+
     MockTaskPtr task_{ nullptr };
     MessageHandler inFunc_{ nullptr };
     MessageHandler outFunc_{ nullptr };
 
-    TcpClientSync tcpc_;
+    size_t threadCount_{ 1 };
+    IoContextPoolPtr pool_{ nullptr };
+    bool ownsPool_{ false };
+    size_t acceptorIndex_{ 0 };
+    std::unique_ptr<boost::asio::ip::tcp::acceptor> acceptor_{ nullptr };
+    // Lets stop close the sessions of a shared pool, which keeps running afterwards
+    std::mutex mutex_;
+    std::unordered_map<uint32_t, std::weak_ptr<TcpMockSession>> sessions_;
+    Payload payload_;
+    // File tasks are mapped once and sent by the kernel, the outHandler is not fed with them
+    MappedFilePtr file_{ nullptr };
+    // The side of the captured connection pcap tasks replay
+    PcapTcpStream::Flow flow_;
+    std::atomic<size_t> sessionCount_{ 0 };
+    std::atomic<uint32_t> sessionId_{ 0 };
+    std::atomic<bool> interrupted_{ false };
 };
-
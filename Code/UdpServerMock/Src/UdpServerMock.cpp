@@ -1,17 +1,459 @@
 #include "UdpServerMock.h"
 #include <Logger/Logger.h>
+#include <boost/asio/post.hpp>
+#include <future>
+#include <cassert>
+#include <cerrno>
 
-bool UdpServerMock::init(const std::string& string)
+namespace
 {
+    // A handler of a shared pool yields after this many batches, an unlimited rate must not starve the other tasks
+    constexpr size_t SHARED_POOL_BATCHES = 64;
+    // Timer wake ups are late by tens of microseconds, the credit lets the pacer catch up on the next batches
+    constexpr uint32_t SHARED_POOL_BURST = 64;
+    constexpr auto STOP_TIMEOUT = std::chrono::seconds(3);
+    constexpr auto STOP_GIVE_UP = std::chrono::seconds(30);
+}
+
+UdpServerMock::~UdpServerMock()
+{
+    stop();
+}
+
+bool UdpServerMock::init(MockTaskPtr task, MessageHandler inHandler, MessageHandler outHandler)
+{
+    task_ = task;
+    inFunc_ = inHandler;
+    outFunc_ = outHandler;
     return true;
 }
 
-void UdpServerMock::start()
+bool UdpServerMock::start()
 {
+    if (worker_.joinable() || pool_ != nullptr)
+    {
+        LOG_WARN("Duplicate start, address={}:{}", task_->ip, task_->port);
+        return false;
+    }
+
+    bool ok = false;
+    switch (task_->type)
+    {
+    case MockTaskItf::File:
+        ok = load(std::static_pointer_cast<FileMockTask>(task_));
+        break;
+    case MockTaskItf::Text:
+        ok = load(std::static_pointer_cast<TextMockTask>(task_));
+        break;
+    case MockTaskItf::Pcap:
+        ok = load(std::static_pointer_cast<PcapMockTask>(task_));
+        break;
+    default:
+        throw std::logic_error("Not implemented");
+    }
+    if (!ok)
+    {
+        return false;
+    }
+
+    boost::system::error_code ec;
+    dest_ = boost::asio::ip::udp::endpoint(boost::asio::ip::make_address(task_->ip, ec), (uint16_t)task_->port);
+    if (!ec)
+    {
+        socket_.open(dest_.protocol(), ec);
+    }
+    if (ec)
+    {
+        LOG_ERROR("Open socket failed, address={}:{}, err={}", task_->ip, task_->port, ec.message());
+        return false;
+    }
 
+    batchSize_ = std::max<size_t>(task_->batchSize, 1);
+    batch_.clear();
+    batch_.reserve(batchSize_);
+#ifdef __linux__
+    iovs_.resize(batchSize_);
+    msgs_.resize(batchSize_);
+#endif
+    batchBytes_ = 0;
+    index_ = 0;
+    loop_ = 0;
+    pending_ = false;
+    replayed_ = 0;
+    sending_ = BatchStats{ batchSize_ };
+    finished_ = false;
+    interrupted_ = false;
+
+    // Captures keep their own timing, the pacer only measures the achieved rate
+    const uint32_t burst = sharedPool_ != nullptr ? SHARED_POOL_BURST : 1;
+    pacer_ = reader_ != nullptr ? std::make_unique<RatePacer>() : std::make_unique<RatePacer>(task_->packetRate, task_->byteRate, burst);
+    if (reader_ != nullptr)
+    {
+        clock_ = std::make_unique<PcapReplayClock>(std::static_pointer_cast<PcapMockTask>(task_)->speed);
+    }
+    reported_ = RatePacer::Clock::now();
+
+    if (sharedPool_ != nullptr)
+    {
+        pool_ = sharedPool_;
+        poolIndex_ = pool_->acquire();
+        timer_ = std::make_unique<boost::asio::steady_timer>(pool_->at(poolIndex_));
+        boost::asio::post(pool_->at(poolIndex_), [this]
+        {
+            doPump();
+        });
+    }
+    else
+    {
+        worker_ = std::thread(&UdpServerMock::doSend, this);
+    }
+    LOG_INFO("Udp server mock started, address={}:{}, datagrams={}, target pps={}, target bps={}, shared={}",
+        task_->ip, task_->port, datagrams_.size(), task_->packetRate, task_->byteRate, pool_ != nullptr);
+    return true;
 }
 
 void UdpServerMock::stop()
 {
+    interrupted_ = true;
+    if (worker_.joinable())
+    {
+        worker_.join();
+    }
+    if (pool_ != nullptr)
+    {
+        // The marker is queued behind the aborted timer handler, once set nothing on the pool refers to this
+        auto stopped = std::make_shared<std::promise<void>>();
+        auto& io = pool_->at(poolIndex_);
+        boost::asio::post(io, [this, &io, stopped]
+        {
+            timer_->cancel();
+            boost::asio::post(io, [stopped]
+            {
+                stopped->set_value();
+            });
+        });
+        // Handlers on the shared pool still hold this and the timer, they are waited for up to the give up time.
+        // A stopped pool never runs them again
+        auto future = stopped->get_future();
+        const auto giveUp = std::chrono::steady_clock::now() + STOP_GIVE_UP;
+        while (pool_->isRunning() && future.wait_for(STOP_TIMEOUT) != std::future_status::ready)
+        {
+            if (std::chrono::steady_clock::now() >= giveUp)
+            {
+                LOG_ERROR("Stop sender gave up, handlers of the shared pool may still refer to the mock, address={}:{}", task_->ip, task_->port);
+                break;
+            }
+            LOG_WARN("Stop sender timeout, address={}:{}", task_->ip, task_->port);
+        }
+        pool_->release(poolIndex_);
+        pool_.reset();
+        timer_.reset();
+    }
+    finish();
+    boost::system::error_code ignored;
+    socket_.close(ignored);
+    datagrams_.clear();
+    reader_.reset();
+    file_.reset();
+}
+
+RatePacer::Stats UdpServerMock::stats() const
+{
+    std::lock_guard<std::mutex> lock(statsMutex_);
+    return stats_;
+}
+
+UdpServerMock::BatchStats UdpServerMock::batchStats() const
+{
+    std::lock_guard<std::mutex> lock(statsMutex_);
+    return batchStats_;
+}
 
+bool UdpServerMock::load(const std::shared_ptr<FileMockTask>& task)
+{
+    assert(task != nullptr);
+    file_ = std::make_shared<MappedFile>();
+    if (!file_->open(task->filepath))
+    {
+        file_.reset();
+        return false;
+    }
+    datagrams_.clear();
+    datagrams_.reserve(file_->size() / DATAGRAM_MAX_LEN + 1);
+    for (size_t pos = 0; pos < file_->size(); pos += DATAGRAM_MAX_LEN)
+    {
+        datagrams_.emplace_back(file_->data() + pos, std::min(DATAGRAM_MAX_LEN, file_->size() - pos));
+    }
+    return true;
 }
+
+bool UdpServerMock::load(const std::shared_ptr<TextMockTask>& task)
+{
+    assert(task != nullptr);
+    // An empty datagram would be sent back to back forever, unpaced when no rate is set
+    if (task->text.empty())
+    {
+        LOG_ERROR("Empty text payload, address={}:{}", task->ip, task->port);
+        return false;
+    }
+    text_ = Message(task->text);
+    datagrams_.assign(1, text_.buffer());
+    return true;
+}
+
+bool UdpServerMock::load(const std::shared_ptr<PcapMockTask>& task)
+{
+    assert(task != nullptr);
+    file_ = std::make_shared<MappedFile>();
+    if (!file_->open(task->filepath))
+    {
+        file_.reset();
+        return false;
+    }
+    reader_ = std::make_unique<PcapReader>(file_);
+    if (!reader_->isValid())
+    {
+        LOG_ERROR("Invalid capture file, path={}, err={}", task->filepath, reader_->error());
+        reader_.reset();
+        file_.reset();
+        return false;
+    }
+    datagrams_.clear();
+    return true;
+}
+
+// Dedicated thread, waits for each batch by sleeping then spinning for stable microsecond gaps
+void UdpServerMock::doSend()
+{
+    RatePacer::Clock::time_point wake;
+    while (pump(wake, SIZE_MAX))
+    {
+        if (!pacer_->waitUntil(wake, interrupted_))
+        {
+            break;
+        }
+    }
+    finish();
+}
+
+// Shared pool, waits on a timer so the thread keeps serving other tasks in between
+void UdpServerMock::doPump()
+{
+    RatePacer::Clock::time_point wake;
+    if (!pump(wake, SHARED_POOL_BATCHES))
+    {
+        return finish();
+    }
+    timer_->expires_at(wake);
+    timer_->async_wait([this](boost::system::error_code ec)
+    {
+        if (!ec)
+        {
+            doPump();
+        }
+    });
+}
+
+// Sends the batches already due, returns false once done, otherwise wake is when to call again
+bool UdpServerMock::pump(RatePacer::Clock::time_point& wake, size_t maxBatches)
+{
+    for (size_t n = 0; n < maxBatches; ++n)
+    {
+        if (interrupted_)
+        {
+            return false;
+        }
+        if (batch_.empty() && !(reader_ != nullptr ? fillReplay() : fill()))
+        {
+            return false;
+        }
+        if (due_ > RatePacer::Clock::now())
+        {
+            wake = due_;
+            return true;
+        }
+
+        boost::system::error_code ec;
+        auto sent = sendBatch(batch_, ec);
+        sending_.batches += 1;
+        sending_.datagrams += sent;
+        sending_.fullBatches += sent == batchSize_ ? 1 : 0;
+        size_t sentBytes = batchBytes_;
+        if (sent < batch_.size())
+        {
+            sentBytes = 0;
+            for (size_t i = 0; i < sent; ++i)
+            {
+                sentBytes += batch_[i].size();
+            }
+        }
+        pacer_->commit(sent, sentBytes);
+        if (ec)
+        {
+            LOG_ERROR("Send failed, address={}:{}, err={}", task_->ip, task_->port, ec.message());
+            return false;
+        }
+        if (outFunc_ != nullptr && file_ == nullptr)
+        {
+            for (size_t i = 0; i < sent; ++i)
+            {
+                outFunc_(text_);
+            }
+        }
+        batch_.clear();
+        batchBytes_ = 0;
+
+        // Checking the clock per batch is cheap compared with the syscall
+        if (RatePacer::Clock::now() - reported_ >= std::chrono::seconds(1))
+        {
+            reported_ = RatePacer::Clock::now();
+            auto s = publish();
+            LOG_DEBUG("Udp send rate, pps={:.0f}/{:.0f}, bps={:.0f}/{:.0f}, batch fill={:.2f}", s.pps, s.targetPps, s.bps, s.targetBps, sending_.averageFill());
+        }
+    }
+    wake = RatePacer::Clock::now();
+    return true;
+}
+
+// A batch may span the end of one loop and the start of the next, a single text datagram still fills it
+bool UdpServerMock::fill()
+{
+    const int loopCount = task_->loopCount;
+    while (batch_.size() < batchSize_ && !datagrams_.empty() && (loopCount <= 0 || loop_ < loopCount))
+    {
+        batch_.push_back(datagrams_[index_]);
+        batchBytes_ += datagrams_[index_].size();
+        if (++index_ == datagrams_.size())
+        {
+            index_ = 0;
+            ++loop_;
+        }
+    }
+    // Zero-length datagrams only would feed sendmmsg empty batches forever, there is nothing to send
+    if (batch_.empty() || batchBytes_ == 0)
+    {
+        batch_.clear();
+        return false;
+    }
+    due_ = pacer_->schedule(batch_.size(), batchBytes_);
+    return true;
+}
+
+// Replays the UDP payloads of a capture with its own timing, packets already due leave in one batch
+bool UdpServerMock::fillReplay()
+{
+    const auto now = PcapReplayClock::Clock::now();
+    while (batch_.size() < batchSize_)
+    {
+        if (!pending_)
+        {
+            if (reader_->next(packet_))
+            {
+                pending_ = packet_.protocol == PcapReader::Udp;
+                continue;
+            }
+            // Every loop ends with its own batch
+            if (!batch_.empty())
+            {
+                break;
+            }
+            if (replayed_ == 0)
+            {
+                LOG_WARN("No udp payload in capture, path={}", file_->path());
+                return false;
+            }
+            if (task_->loopCount > 0 && ++loop_ >= task_->loopCount)
+            {
+                return false;
+            }
+            replayed_ = 0;
+            reader_->rewind();
+            clock_->restart();
+            continue;
+        }
+        auto due = clock_->isPaced() ? clock_->due(packet_.time) : PcapReplayClock::Clock::time_point();
+        if (!batch_.empty() && due > std::max(due_, now))
+        {
+            break;
+        }
+        if (batch_.empty())
+        {
+            due_ = due;
+        }
+        batch_.emplace_back(packet_.data, packet_.size);
+        batchBytes_ += packet_.size;
+        pending_ = false;
+        replayed_ += 1;
+    }
+    return true;
+}
+
+void UdpServerMock::finish()
+{
+    if (finished_)
+    {
+        return;
+    }
+    finished_ = true;
+    auto s = publish();
+    LOG_INFO("Udp server mock finished, packets={}, bytes={}, seconds={:.3f}, pps={:.0f}/{:.0f}, bps={:.0f}/{:.0f}, batches={}, batch fill={:.2f}",
+        s.packets, s.bytes, s.seconds, s.pps, s.targetPps, s.bps, s.targetBps, sending_.batches, sending_.averageFill());
+}
+
+RatePacer::Stats UdpServerMock::publish()
+{
+    auto s = pacer_->stats();
+    std::lock_guard<std::mutex> lock(statsMutex_);
+    stats_ = s;
+    batchStats_ = sending_;
+    return s;
+}
+
+size_t UdpServerMock::sendBatch(const std::vector<boost::asio::const_buffer>& batch, boost::system::error_code& ec)
+{
+#ifdef __linux__
+    if (batch.size() > 1)
+    {
+        assert(batch.size() <= msgs_.size());
+        for (size_t i = 0; i < batch.size(); ++i)
+        {
+            iovs_[i].iov_base = const_cast<void*>(batch[i].data());
+            iovs_[i].iov_len = batch[i].size();
+            msgs_[i] = mmsghdr{};
+            msgs_[i].msg_hdr.msg_name = dest_.data();
+            msgs_[i].msg_hdr.msg_namelen = (socklen_t)dest_.size();
+            msgs_[i].msg_hdr.msg_iov = &iovs_[i];
+            msgs_[i].msg_hdr.msg_iovlen = 1;
+        }
+
+        // sendmmsg may stop short of the whole batch, continue from the first unsent datagram
+        size_t sent = 0;
+        while (sent < batch.size())
+        {
+            int n = ::sendmmsg(socket_.native_handle(), msgs_.data() + sent, (unsigned)(batch.size() - sent), 0);
+            if (n < 0)
+            {
+                if (errno == EINTR)
+                {
+                    continue;
+                }
+                ec.assign(errno, boost::system::system_category());
+                break;
+            }
+            sent += n;
+        }
+        return sent;
+    }
+#endif
+    for (size_t i = 0; i < batch.size(); ++i)
+    {
+        socket_.send_to(batch[i], dest_, 0, ec);
+        if (ec)
+        {
+            return i;
+        }
+    }
+    return batch.size();
+}
+
+DECLEAR_MOCK(UdpServerMock)
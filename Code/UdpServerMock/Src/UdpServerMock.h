@@ -1,15 +1,108 @@
 #pragma once
 
 #include "MockItf.h"
+#include "MappedFile.h"
+#include "RatePacer.h"
+#include "PcapReader.h"
+#include <boost/asio/io_context.hpp>
+#include <boost/asio/ip/udp.hpp>
+#include <boost/asio/steady_timer.hpp>
+#include <memory>
+#include <vector>
+#include <thread>
+#include <mutex>
+#include <atomic>
 
-class UdpServerMock : MockItf
+#ifdef __linux__
+#include <sys/socket.h>
+#endif
+
+class UdpServerMock : public MockItf
 {
 public:
-    ~UdpServerMock() override = default;
+    // Files are cut into datagrams of this size, fits an ethernet frame without fragmentation
+    static constexpr size_t DATAGRAM_MAX_LEN = 1472;
+
+    struct BatchStats
+    {
+        size_t batchSize{ 1 };
+        uint64_t batches{ 0 };
+        uint64_t datagrams{ 0 };
+        uint64_t fullBatches{ 0 };
+
+        [[nodiscard]] double averageFill() const
+        {
+            return batches == 0 ? 0 : (double)datagrams / batches / batchSize;
+        }
+    };
 
 public:
-    bool init(const std::string& string) override;
-    void start() override;
+    ~UdpServerMock() override;
+
+public:
+    bool init(MockTaskPtr task, MessageHandler inHandler, MessageHandler outHandler) override;
+    bool start() override;
     void stop() override;
-};
 
+    // Achieved rate of the running or last run, compared with the configured target
+    [[nodiscard]] RatePacer::Stats stats() const;
+    [[nodiscard]] BatchStats batchStats() const;
+
+private:
+    bool load(const std::shared_ptr<FileMockTask>&);
+    bool load(const std::shared_ptr<TextMockTask>&);
+    bool load(const std::shared_ptr<PcapMockTask>&);
+    void doSend();
+    void doPump();
+    bool pump(RatePacer::Clock::time_point& wake, size_t maxBatches);
+    bool fill();
+    bool fillReplay();
+    void finish();
+    RatePacer::Stats publish();
+    size_t sendBatch(const std::vector<boost::asio::const_buffer>& batch, boost::system::error_code& ec);
+
+private:
+    MockTaskPtr task_{ nullptr };
+    MessageHandler inFunc_{ nullptr };
+    MessageHandler outFunc_{ nullptr };
+
+    Message text_;
+    MappedFilePtr file_{ nullptr };
+    std::vector<boost::asio::const_buffer> datagrams_;
+    std::unique_ptr<PcapReader> reader_{ nullptr };
+#ifdef __linux__
+    std::vector<iovec> iovs_;
+    std::vector<mmsghdr> msgs_;
+#endif
+
+    boost::asio::io_context io_{ 1 };
+    boost::asio::ip::udp::socket socket_{ io_ };
+    boost::asio::ip::udp::endpoint dest_;
+    std::thread worker_;
+    std::atomic<bool> interrupted_{ false };
+
+    // On a shared pool the sender is a timer on one of its io_contexts instead of a thread
+    IoContextPoolPtr pool_{ nullptr };
+    size_t poolIndex_{ 0 };
+    std::unique_ptr<boost::asio::steady_timer> timer_{ nullptr };
+
+    // Sender state, only touched by the thread or the handler driving pump
+    std::unique_ptr<RatePacer> pacer_{ nullptr };
+    std::unique_ptr<PcapReplayClock> clock_{ nullptr };
+    std::vector<boost::asio::const_buffer> batch_;
+    size_t batchBytes_{ 0 };
+    size_t batchSize_{ 1 };
+    RatePacer::Clock::time_point due_;
+    RatePacer::Clock::time_point reported_;
+    size_t index_{ 0 };
+    int loop_{ 0 };
+    PcapReader::Packet packet_;
+    bool pending_{ false };
+    size_t replayed_{ 0 };
+    BatchStats sending_;
+    bool finished_{ true };
+
+    mutable std::mutex statsMutex_;
+    RatePacer::Stats stats_;
+    BatchStats batchStats_;
+};
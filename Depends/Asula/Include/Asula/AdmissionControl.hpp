@@ -0,0 +1,375 @@
+#pragma once
+
+#include <boost/asio.hpp>
+#include <chrono>
+#include <functional>
+#include <memory>
+#include <mutex>
+#include <list>
+#include <utility>
+#include <algorithm>
+#include <cstdint>
+
+namespace http
+{
+    namespace net = boost::asio;
+
+    // A waiting request of a higher priority is admitted first and pushes lower ones out of a full queue
+    enum RoutePriority : uint8_t
+    {
+        PRIORITY_LATENCY,
+        PRIORITY_NORMAL,
+        PRIORITY_BULK,
+    };
+
+    /**
+     * Bounds the connections of a server, its requests in flight and the requests waiting for a slot.
+     * A request is in flight from its admission until its response is written. One over the limits waits
+     * in a bounded queue ordered by priority, or is rejected at once so the caller can answer 503.
+     */
+    class AdmissionControl final
+    {
+    public:
+        struct Limits
+        {
+            // 0 is unlimited
+            size_t maxConnections{ 0 };
+            size_t maxInFlight{ 0 };
+            // Requests waiting for a slot, 0 rejects a request as soon as no slot is free
+            size_t maxQueue{ 0 };
+            std::chrono::milliseconds maxQueueTime{ 1000 };
+            // Seconds of the Retry-After header of a rejection
+            int retryAfter{ 1 };
+        };
+
+        struct Stats
+        {
+            size_t connections{ 0 };
+            size_t inFlight{ 0 };
+            size_t queued{ 0 };
+            uint64_t admitted{ 0 };
+            uint64_t rejectedConnections{ 0 };
+            // Queue full, or no queue
+            uint64_t rejectedRequests{ 0 };
+            // Pushed out of a full queue by a request of a higher priority
+            uint64_t evicted{ 0 };
+            uint64_t timedOut{ 0 };
+            // Over the requests that waited, admitted or not
+            uint64_t waited{ 0 };
+            uint64_t queueTimeUs{ 0 };
+            uint64_t maxQueueTimeUs{ 0 };
+        };
+
+        // Holds an admitted connection or request, the slot is released when destroyed
+        class Ticket
+        {
+        public:
+            Ticket() = default;
+
+            Ticket(Ticket&& other) noexcept
+                : owner_(std::exchange(other.owner_, nullptr))
+                , route_(other.route_)
+                , request_(other.request_)
+            {
+
+            }
+
+            Ticket& operator=(Ticket&& other) noexcept
+            {
+                if (this != &other)
+                {
+                    reset();
+                    owner_ = std::exchange(other.owner_, nullptr);
+                    route_ = other.route_;
+                    request_ = other.request_;
+                }
+                return *this;
+            }
+
+            ~Ticket()
+            {
+                reset();
+            }
+
+            explicit operator bool() const
+            {
+                return owner_ != nullptr;
+            }
+
+            void reset()
+            {
+                if (owner_ != nullptr)
+                {
+                    std::exchange(owner_, nullptr)->release(route_, request_);
+                }
+            }
+
+        private:
+            friend class AdmissionControl;
+
+            Ticket(AdmissionControl* owner, size_t* route, bool request)
+                : owner_(owner)
+                , route_(route)
+                , request_(request)
+            {
+
+            }
+
+            AdmissionControl* owner_{ nullptr };
+            size_t* route_{ nullptr };
+            bool request_{ false };
+        };
+
+    public:
+        AdmissionControl() = default;
+
+        AdmissionControl(const AdmissionControl&) = delete;
+        AdmissionControl& operator=(const AdmissionControl&) = delete;
+
+    public:
+        // Call this method before serving
+        void setLimits(const Limits& limits)
+        {
+            limits_ = limits;
+            enabled_ = limits.maxConnections > 0 || limits.maxInFlight > 0;
+        }
+
+        [[nodiscard]] const Limits& limits() const
+        {
+            return limits_;
+        }
+
+        // Routes with a maxInFlight of their own are limited even when the server is not
+        [[nodiscard]] bool enabled(size_t routeMaxInFlight = 0) const
+        {
+            return enabled_ || routeMaxInFlight > 0;
+        }
+
+        Ticket connect()
+        {
+            std::lock_guard<std::mutex> lock(mutex_);
+            if (limits_.maxConnections > 0 && connections_ >= limits_.maxConnections)
+            {
+                rejectedConnections_ += 1;
+                return {};
+            }
+            connections_ += 1;
+            return { this, nullptr, false };
+        }
+
+        // routeInFlight is the counter of the route, guarded by this object, a routeMaxInFlight of 0 is unlimited
+        net::awaitable<Ticket> admit(RoutePriority priority, size_t routeMaxInFlight, size_t* routeInFlight)
+        {
+            auto executor = co_await net::this_coro::executor;
+            std::shared_ptr<Waiter> waiter;
+            {
+                std::lock_guard<std::mutex> lock(mutex_);
+                if (fits(routeMaxInFlight, routeInFlight))
+                {
+                    take(routeInFlight);
+                    co_return Ticket{ this, routeInFlight, true };
+                }
+                if (queue_.size() >= limits_.maxQueue && !evict(priority))
+                {
+                    rejectedRequests_ += 1;
+                    co_return Ticket{};
+                }
+                waiter = std::make_shared<Waiter>(executor, priority, routeMaxInFlight, routeInFlight);
+                waiter->timer.expires_after(limits_.maxQueueTime);
+                queue_.push_back(waiter);
+            }
+
+            const auto start = std::chrono::steady_clock::now();
+            // A named initiation, GCC 12 destroys a capturing temporary of a co_await expression twice
+            auto park = [this, waiter](auto handler)
+            {
+                std::function<void()> resume = [h = std::make_shared<decltype(handler)>(std::move(handler))]
+                {
+                    auto executor = net::get_associated_executor(*h);
+                    net::post(executor, std::move(*h));
+                };
+                std::unique_lock<std::mutex> lock(mutex_);
+                // Granted or evicted before the wait started
+                if (waiter->state != Waiter::WAITING)
+                {
+                    lock.unlock();
+                    resume();
+                    return;
+                }
+                waiter->resume = std::move(resume);
+                waiter->timer.async_wait([this, waiter](const boost::system::error_code& ec)
+                {
+                    if (!ec)
+                    {
+                        expire(waiter);
+                    }
+                });
+            };
+            co_await net::async_initiate<decltype(net::use_awaitable), void()>(park, net::use_awaitable);
+            // Only this coroutine touches the timer, a grant or an eviction from another thread never does
+            waiter->timer.cancel();
+
+            std::lock_guard<std::mutex> lock(mutex_);
+            auto us = (uint64_t)std::chrono::duration_cast<std::chrono::microseconds>(std::chrono::steady_clock::now() - start).count();
+            waited_ += 1;
+            queueTimeUs_ += us;
+            maxQueueTimeUs_ = std::max(maxQueueTimeUs_, us);
+            if (waiter->state == Waiter::GRANTED)
+            {
+                co_return Ticket{ this, routeInFlight, true };
+            }
+            co_return Ticket{};
+        }
+
+        [[nodiscard]] Stats stats() const
+        {
+            std::lock_guard<std::mutex> lock(mutex_);
+            return Stats{ connections_, inFlight_, queue_.size(), admitted_, rejectedConnections_, rejectedRequests_,
+                          evicted_, timedOut_, waited_, queueTimeUs_, maxQueueTimeUs_ };
+        }
+
+    private:
+        struct Waiter
+        {
+            enum State : uint8_t
+            {
+                WAITING,
+                GRANTED,
+                EVICTED,
+                TIMED_OUT,
+            };
+
+            Waiter(const net::any_io_executor& executor, RoutePriority priority, size_t maxInFlight, size_t* route)
+                : timer(executor)
+                , priority(priority)
+                , maxInFlight(maxInFlight)
+                , route(route)
+            {
+
+            }
+
+            net::steady_timer timer;
+            RoutePriority priority{ PRIORITY_NORMAL };
+            size_t maxInFlight{ 0 };
+            size_t* route{ nullptr };
+            State state{ WAITING };
+            // Resumes the admitting coroutine, taken under the mutex by the first of a grant, an eviction or the timeout
+            std::function<void()> resume;
+        };
+
+        using WaiterPtr = std::shared_ptr<Waiter>;
+
+        // Called with the mutex held
+        bool fits(size_t routeMax, const size_t* route) const
+        {
+            return (limits_.maxInFlight == 0 || inFlight_ < limits_.maxInFlight)
+                && (routeMax == 0 || route == nullptr || *route < routeMax);
+        }
+
+        void take(size_t* route)
+        {
+            inFlight_ += 1;
+            admitted_ += 1;
+            if (route != nullptr)
+            {
+                *route += 1;
+            }
+        }
+
+        // Called with the mutex held, the coroutine resumes on its own executor
+        static void wake(const WaiterPtr& waiter, Waiter::State state)
+        {
+            waiter->state = state;
+            std::function<void()> resume;
+            resume.swap(waiter->resume);
+            if (resume)
+            {
+                resume();
+            }
+        }
+
+        void expire(const WaiterPtr& waiter)
+        {
+            std::lock_guard<std::mutex> lock(mutex_);
+            if (waiter->state != Waiter::WAITING)
+            {
+                return;
+            }
+            queue_.remove(waiter);
+            timedOut_ += 1;
+            wake(waiter, Waiter::TIMED_OUT);
+        }
+
+        // The newest waiter of the lowest priority below the given one leaves the queue, called with the mutex held
+        bool evict(RoutePriority priority)
+        {
+            auto victim = queue_.end();
+            for (auto it = queue_.begin(); it != queue_.end(); ++it)
+            {
+                if ((*it)->priority > priority && (victim == queue_.end() || (*it)->priority >= (*victim)->priority))
+                {
+                    victim = it;
+                }
+            }
+            if (victim == queue_.end())
+            {
+                return false;
+            }
+            wake(*victim, Waiter::EVICTED);
+            queue_.erase(victim);
+            evicted_ += 1;
+            return true;
+        }
+
+        void release(size_t* route, bool request)
+        {
+            std::lock_guard<std::mutex> lock(mutex_);
+            if (!request)
+            {
+                connections_ -= 1;
+                return;
+            }
+            inFlight_ -= 1;
+            if (route != nullptr)
+            {
+                *route -= 1;
+            }
+            // Oldest waiter of the highest priority whose route has room, until no slot is left
+            for (;;)
+            {
+                auto next = queue_.end();
+                for (auto it = queue_.begin(); it != queue_.end(); ++it)
+                {
+                    if (fits((*it)->maxInFlight, (*it)->route) && (next == queue_.end() || (*it)->priority < (*next)->priority))
+                    {
+                        next = it;
+                    }
+                }
+                if (next == queue_.end())
+                {
+                    return;
+                }
+                take((*next)->route);
+                wake(*next, Waiter::GRANTED);
+                queue_.erase(next);
+            }
+        }
+
+    private:
+        Limits limits_;
+        bool enabled_{ false };
+
+        mutable std::mutex mutex_;
+        std::list<WaiterPtr> queue_;
+        size_t connections_{ 0 };
+        size_t inFlight_{ 0 };
+        uint64_t admitted_{ 0 };
+        uint64_t rejectedConnections_{ 0 };
+        uint64_t rejectedRequests_{ 0 };
+        uint64_t evicted_{ 0 };
+        uint64_t timedOut_{ 0 };
+        uint64_t waited_{ 0 };
+        uint64_t queueTimeUs_{ 0 };
+        uint64_t maxQueueTimeUs_{ 0 };
+    };
+}  // namespace http
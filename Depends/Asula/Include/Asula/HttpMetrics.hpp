@@ -0,0 +1,371 @@
+#pragma once
+
+#include <Logger/Logger.h>
+#include <array>
+#include <atomic>
+#include <bit>
+#include <map>
+#include <memory>
+#include <mutex>
+#include <string>
+#include <string_view>
+#include <vector>
+#include <cstdint>
+
+namespace http
+{
+    /**
+     * HDR style histogram: values below 16 have a bucket each, every power of two above is split into 16 linear
+     * buckets, so a recorded value is known within 6.25% whatever its magnitude. Recording is two relaxed adds.
+     */
+    class Histogram final
+    {
+    public:
+        static constexpr int SUB_BITS = 4;
+        static constexpr uint64_t SUB_COUNT = 1u << SUB_BITS;
+        // Larger values are recorded as the largest, about 12 days in microseconds or a terabyte
+        static constexpr uint64_t MAX_VALUE = (1ull << 40) - 1;
+        static constexpr size_t BUCKET_COUNT = (40 - SUB_BITS + 1) * SUB_COUNT;
+
+        // Counts merged from the histograms of every thread
+        struct Snapshot
+        {
+            std::vector<uint64_t> counts = std::vector<uint64_t>(BUCKET_COUNT);
+            uint64_t count{ 0 };
+            uint64_t sum{ 0 };
+
+            void merge(const Histogram& h)
+            {
+                for (size_t i = 0; i < BUCKET_COUNT; ++i)
+                {
+                    auto n = h.counts_[i].load(std::memory_order_relaxed);
+                    counts[i] += n;
+                    count += n;
+                }
+                sum += h.sum_.load(std::memory_order_relaxed);
+            }
+
+            // Every recorded value in the buckets up to the one holding bound,
+            // exactly the values not above bound when bound is the highest of its bucket, see edge
+            [[nodiscard]] uint64_t countUpTo(uint64_t bound) const
+            {
+                const auto last = index(std::min(bound, MAX_VALUE));
+                uint64_t n = 0;
+                for (size_t i = 0; i <= last; ++i)
+                {
+                    n += counts[i];
+                }
+                return n;
+            }
+
+            // Highest value equivalent to the one at quantile q
+            [[nodiscard]] uint64_t quantile(double q) const
+            {
+                if (count == 0)
+                {
+                    return 0;
+                }
+                auto rank = std::max<uint64_t>(1, (uint64_t)(q * (double)count + 0.5));
+                uint64_t n = 0;
+                for (size_t i = 0; i < BUCKET_COUNT; ++i)
+                {
+                    n += counts[i];
+                    if (n >= rank)
+                    {
+                        return highest(i);
+                    }
+                }
+                return MAX_VALUE;
+            }
+        };
+
+    public:
+        void record(uint64_t value)
+        {
+            value = std::min(value, MAX_VALUE);
+            counts_[index(value)].fetch_add(1, std::memory_order_relaxed);
+            sum_.fetch_add(value, std::memory_order_relaxed);
+        }
+
+        static size_t index(uint64_t value)
+        {
+            if (value < SUB_COUNT)
+            {
+                return (size_t)value;
+            }
+            const int shift = (int)std::bit_width(value) - 1 - SUB_BITS;
+            return (size_t)(shift + 1) * SUB_COUNT + (size_t)((value >> shift) - SUB_COUNT);
+        }
+
+        // Lowest bucket edge not below value: the values not above it fill whole buckets
+        static uint64_t edge(uint64_t value)
+        {
+            return highest(index(std::min(value, MAX_VALUE)));
+        }
+
+        static uint64_t highest(size_t index)
+        {
+            if (index < SUB_COUNT)
+            {
+                return index;
+            }
+            const auto shift = index / SUB_COUNT - 1;
+            const auto sub = index % SUB_COUNT + SUB_COUNT;
+            return ((sub + 1) << shift) - 1;
+        }
+
+    private:
+        std::array<std::atomic<uint64_t>, BUCKET_COUNT> counts_{};
+        std::atomic<uint64_t> sum_{ 0 };
+    };
+
+    /**
+     * Latency, request and response sizes and status classes of one route.
+     * Every thread records into a shard of its own, created on its first request, a scrape merges them.
+     */
+    class RouteMetrics final
+    {
+    public:
+        // Threads beyond this share shards, still safe since every update is atomic
+        static constexpr size_t MAX_SHARDS = 64;
+
+        struct Shard
+        {
+            Histogram latencyUs;
+            Histogram requestBytes;
+            Histogram responseBytes;
+            // 1xx to 5xx
+            std::array<std::atomic<uint64_t>, 5> statuses{};
+        };
+
+        struct Snapshot
+        {
+            Histogram::Snapshot latencyUs;
+            Histogram::Snapshot requestBytes;
+            Histogram::Snapshot responseBytes;
+            std::array<uint64_t, 5> statuses{};
+        };
+
+    public:
+        RouteMetrics(std::string method, std::string route)
+            : method_(std::move(method))
+            , route_(std::move(route))
+        {
+
+        }
+
+        RouteMetrics(const RouteMetrics&) = delete;
+        RouteMetrics& operator=(const RouteMetrics&) = delete;
+
+        ~RouteMetrics()
+        {
+            for (auto& shard : shards_)
+            {
+                delete shard.load();
+            }
+        }
+
+    public:
+        void record(uint64_t latencyUs, uint64_t requestBytes, uint64_t responseBytes, int status)
+        {
+            auto& shard = local();
+            shard.latencyUs.record(latencyUs);
+            shard.requestBytes.record(requestBytes);
+            shard.responseBytes.record(responseBytes);
+            if (status >= 100 && status < 600)
+            {
+                shard.statuses[status / 100 - 1].fetch_add(1, std::memory_order_relaxed);
+            }
+        }
+
+        [[nodiscard]] Snapshot snapshot() const
+        {
+            Snapshot s;
+            for (const auto& it : shards_)
+            {
+                const auto* shard = it.load(std::memory_order_acquire);
+                if (shard == nullptr)
+                {
+                    continue;
+                }
+                s.latencyUs.merge(shard->latencyUs);
+                s.requestBytes.merge(shard->requestBytes);
+                s.responseBytes.merge(shard->responseBytes);
+                for (size_t i = 0; i < s.statuses.size(); ++i)
+                {
+                    s.statuses[i] += shard->statuses[i].load(std::memory_order_relaxed);
+                }
+            }
+            return s;
+        }
+
+        [[nodiscard]] const std::string& method() const
+        {
+            return method_;
+        }
+
+        [[nodiscard]] const std::string& route() const
+        {
+            return route_;
+        }
+
+    private:
+        static size_t slot()
+        {
+            static std::atomic<size_t> next{ 0 };
+            thread_local size_t slot = next++ % MAX_SHARDS;
+            return slot;
+        }
+
+        Shard& local()
+        {
+            auto& it = shards_[slot()];
+            auto* shard = it.load(std::memory_order_acquire);
+            if (shard != nullptr)
+            {
+                return *shard;
+            }
+            auto* created = new Shard;
+            if (it.compare_exchange_strong(shard, created, std::memory_order_acq_rel))
+            {
+                return *created;
+            }
+            delete created;
+            return *shard;
+        }
+
+    private:
+        const std::string method_;
+        const std::string route_;
+        std::array<std::atomic<Shard*>, MAX_SHARDS> shards_{};
+    };
+
+    /**
+     * Metrics of every route a server ever had, in the Prometheus text exposition format.
+     * Entries are never removed, a route hooked again continues its series and the pointers held by hooks stay valid.
+     */
+    class MetricsRegistry final
+    {
+    public:
+        MetricsRegistry() = default;
+
+        MetricsRegistry(const MetricsRegistry&) = delete;
+        MetricsRegistry& operator=(const MetricsRegistry&) = delete;
+
+    public:
+        RouteMetrics* route(const std::string& method, const std::string& route)
+        {
+            std::lock_guard<std::mutex> lock(mutex_);
+            auto& metrics = routes_[{ method, route }];
+            if (metrics == nullptr)
+            {
+                metrics = std::make_unique<RouteMetrics>(method, route);
+            }
+            return metrics.get();
+        }
+
+        void write(std::string& out) const
+        {
+            std::vector<std::pair<const RouteMetrics*, RouteMetrics::Snapshot>> snapshots;
+            {
+                std::lock_guard<std::mutex> lock(mutex_);
+                for (const auto& it : routes_)
+                {
+                    snapshots.emplace_back(it.second.get(), it.second->snapshot());
+                }
+            }
+
+            // In recorded units, microseconds and bytes. Each is exported as the bucket edge at or above it, so 100us is le="0.000103"
+            static const std::vector<uint64_t> LATENCY_BOUNDS{ 100, 250, 500, 1000, 2500, 5000, 10000, 25000, 50000, 100000, 250000, 500000, 1000000, 2500000, 5000000, 10000000 };
+            static const std::vector<uint64_t> SIZE_BOUNDS{ 64, 256, 1024, 4096, 16384, 65536, 262144, 1048576, 4194304, 16777216 };
+
+            header(out, "asula_http_request_duration_seconds", "histogram", "Time from the request header read to the response written");
+            for (const auto& [m, s] : snapshots)
+            {
+                histogram(out, "asula_http_request_duration_seconds", *m, s.latencyUs, LATENCY_BOUNDS, true);
+            }
+            header(out, "asula_http_request_duration_quantile_seconds", "gauge", "Latency quantiles since start, within 6.25%");
+            for (const auto& [m, s] : snapshots)
+            {
+                for (auto q : { 0.5, 0.9, 0.99, 0.999 })
+                {
+                    out += fmt::format("asula_http_request_duration_quantile_seconds{{{},quantile=\"{}\"}} {}\n", labels(*m), q, seconds(s.latencyUs.quantile(q)));
+                }
+            }
+            header(out, "asula_http_request_size_bytes", "histogram", "Request body sizes");
+            for (const auto& [m, s] : snapshots)
+            {
+                histogram(out, "asula_http_request_size_bytes", *m, s.requestBytes, SIZE_BOUNDS, false);
+            }
+            header(out, "asula_http_response_size_bytes", "histogram", "Response body sizes");
+            for (const auto& [m, s] : snapshots)
+            {
+                histogram(out, "asula_http_response_size_bytes", *m, s.responseBytes, SIZE_BOUNDS, false);
+            }
+            header(out, "asula_http_responses_total", "counter", "Responses by status class");
+            for (const auto& [m, s] : snapshots)
+            {
+                for (size_t i = 0; i < s.statuses.size(); ++i)
+                {
+                    if (s.statuses[i] > 0)
+                    {
+                        out += fmt::format("asula_http_responses_total{{{},code=\"{}xx\"}} {}\n", labels(*m), i + 1, s.statuses[i]);
+                    }
+                }
+            }
+        }
+
+        static std::string seconds(uint64_t us)
+        {
+            return fmt::format("{}.{:06}", us / 1000000, us % 1000000);
+        }
+
+        static void header(std::string& out, std::string_view name, std::string_view type, std::string_view help)
+        {
+            out += fmt::format("# HELP {} {}\n# TYPE {} {}\n", name, help, name, type);
+        }
+
+    private:
+        static std::string escape(std::string_view value)
+        {
+            std::string ret;
+            for (auto c : value)
+            {
+                if (c == '\n')
+                {
+                    ret += "\\n";
+                    continue;
+                }
+                if (c == '\\' || c == '"')
+                {
+                    ret += '\\';
+                }
+                ret += c;
+            }
+            return ret;
+        }
+
+        static std::string labels(const RouteMetrics& m)
+        {
+            return fmt::format("method=\"{}\",route=\"{}\"", escape(m.method()), escape(m.route()));
+        }
+
+        // Microseconds are exposed as seconds. Bounds are moved up to bucket edges so every le count is exact
+        static void histogram(std::string& out, std::string_view name, const RouteMetrics& m, const Histogram::Snapshot& s, const std::vector<uint64_t>& bounds, bool us)
+        {
+            const auto l = labels(m);
+            for (auto bound : bounds)
+            {
+                const auto le = Histogram::edge(bound);
+                out += fmt::format("{}_bucket{{{},le=\"{}\"}} {}\n", name, l, us ? seconds(le) : std::to_string(le), s.countUpTo(le));
+            }
+            out += fmt::format("{}_bucket{{{},le=\"+Inf\"}} {}\n", name, l, s.count);
+            out += fmt::format("{}_sum{{{}}} {}\n", name, l, us ? seconds(s.sum) : std::to_string(s.sum));
+            out += fmt::format("{}_count{{{}}} {}\n", name, l, s.count);
+        }
+
+    private:
+        mutable std::mutex mutex_;
+        std::map<std::pair<std::string, std::string>, std::unique_ptr<RouteMetrics>> routes_;
+    };
+}  // namespace http
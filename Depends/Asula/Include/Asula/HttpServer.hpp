@@ -5,23 +5,44 @@
 
 #pragma once
 
+#include "StaticFileCache.hpp"
+#include "AdmissionControl.hpp"
+#include "HttpMetrics.hpp"
+#include "WebSocketDeflate.hpp"
 #include <Logger/Logger.h>
 
 #include <boost/beast/core.hpp>
 #include <boost/beast/http.hpp>
 #include <boost/beast/websocket.hpp>
 #include <boost/asio.hpp>
-#include <boost/asio/spawn.hpp>
 #include <boost/algorithm/string.hpp>
 #include <boost/lexical_cast.hpp>
+#include <boost/container/small_vector.hpp>
+#include <boost/intrusive/list.hpp>
 #include <functional>
 #include <memory>
 #include <string>
 #include <set>
+#include <deque>
+#include <map>
+#include <optional>
+#include <array>
+#include <vector>
+#include <string_view>
+#include <algorithm>
+#include <atomic>
+#include <mutex>
 #include <utility>
+#include <random>
+#include <limits>
 #include <cstdlib>
 #include <cassert>
 
+#ifdef __linux__
+#include <sys/sendfile.h>
+#include <cerrno>
+#endif
+
 
 namespace http
 {
@@ -98,53 +119,121 @@ namespace http
         return result;
     }
 
-    static std::string decodeUri(const string_view& url)
+    static int hexValue(char c)
+    {
+        if (c >= '0' && c <= '9')
+        {
+            return c - '0';
+        }
+        c = (char)(c | 0x20);
+        return c >= 'a' && c <= 'f' ? c - 'a' + 10 : -1;
+    }
+
+    // Decodes %XX and '+' of a query component, a malformed escape is kept as is
+    static std::string percentDecode(std::string_view s)
     {
         std::string ret;
-        for (size_t i = 0, len = url.length(); i < len; i++)
+        ret.reserve(s.size());
+        for (size_t i = 0; i < s.size(); ++i)
         {
-            if (url[i] == '%')
-            {
-                uint8_t ch = 0;
-                try
-                {
-                    boost::lexical_cast<uint8_t>(url.substr(i + 1, 2));
-                }
-                catch (const boost::bad_lexical_cast&)
-                {
-                    // use default value
-                }
-                ret += ch;
-                i = i + 2;
-            }
-            else if (url[i] == '+')
+            if (s[i] == '%' && i + 2 < s.size() && hexValue(s[i + 1]) >= 0 && hexValue(s[i + 2]) >= 0)
             {
-                ret += ' ';
+                ret += (char)(hexValue(s[i + 1]) * 16 + hexValue(s[i + 2]));
+                i += 2;
             }
             else
             {
-                ret += url[i];
+                ret += s[i] == '+' ? ' ' : s[i];
             }
         }
-        return boost::to_lower_copy(ret);
+        return ret;
     }
 
+    /**
+     * A query or route argument, both views into the request owned by the session.
+     * Values are decoded on access, an argument without escapes is never copied.
+     */
+    struct Argument
+    {
+        std::string_view key;
+        std::string_view value;
+        bool encoded{ false };
+        bool encodedKey{ false };
+
+        [[nodiscard]] std::string decoded() const
+        {
+            return encoded ? percentDecode(value) : std::string(value);
+        }
+
+        [[nodiscard]] std::string decodedKey() const
+        {
+            return encodedKey ? percentDecode(key) : std::string(key);
+        }
+
+        // Case insensitive, an escaped key is decoded for the comparison only
+        [[nodiscard]] bool hasKey(std::string_view name) const
+        {
+            return encodedKey ? boost::iequals(percentDecode(key), name) : boost::iequals(key, name);
+        }
+    };
+
+    // Typical requests carry few arguments, they stay inside the session
+    using Arguments = boost::container::small_vector<Argument, 8>;
+
 
 
     /************************************************************************/
     /*                                                                      */
     /************************************************************************/
+    // How the body of a request reaches the hook of its route
+    enum BodyMode : uint8_t
+    {
+        // Whole in request().body()
+        BODY_BUFFERED,
+        // Chunks handed to RoutePolicy::onBody as they arrive, the hook runs after the last one
+        BODY_STREAMED,
+        // Written to a temporary file as it arrives, the hook finds it at Session::bodyFile()
+        BODY_SPOOLED,
+    };
+
+    // Where the hook of a route runs
+    enum HandlerMode : uint8_t
+    {
+        // On the io thread of the connection, the hook replies before it returns
+        HANDLER_INLINE,
+        // On the worker pool of the server, the hook may reply later from any thread
+        HANDLER_OFFLOADED,
+    };
+
+    // Takes a chunk of a streamed body, false rejects the request
+    using BodyFunc = std::function<bool(const SessionPtr&, std::string_view)>;
+
+    struct RoutePolicy
+    {
+        RoutePriority priority{ PRIORITY_NORMAL };
+        // Requests of the route handled at once, 0 is unlimited
+        size_t maxInFlight{ 0 };
+        BodyMode body{ BODY_BUFFERED };
+        // Larger bodies are answered 413, 0 takes the limit of the server
+        uint64_t maxBodySize{ 0 };
+        BodyFunc onBody{ nullptr };
+        // Hooks doing disk or database work are offloaded, the other connections of the io thread keep being served
+        HandlerMode handler{ HANDLER_INLINE };
+    };
+
     struct Route
     {
         std::string method;
         std::string url;
         HookFunc handler;
+        RoutePolicy policy;
 
-        Route(const std::string& method, const std::string& url, HookFunc handler)
+        Route(const std::string& method, const std::string& url, HookFunc handler, RoutePolicy policy = {})
         {
             this->method = boost::to_upper_copy(method);
             this->url = boost::starts_with(url, "/") ? url : ("/" + url);
             this->handler = std::move(handler);
+            this->policy = policy;
         }
 
         ~Route()
@@ -162,164 +251,425 @@ namespace http
     /************************************************************************/
     /*                                                                      */
     /************************************************************************/
+    /**
+     * Routes of every verb compiled into a trie keyed by path segment.
+     * A <param> or [param] segment is a single wildcard child of its node, literals are looked up by name,
+     * so matching costs one walk over the request path whatever the number of registered routes.
+     * A route also handles the paths below it, the most specific route wins: a literal segment
+     * weighs more than a wildcard and a deeper route more than its prefix.
+     *
+     * The routes are an immutable snapshot, writers publish a new one sharing every untouched node,
+     * so routes may be added or removed while serving. Each io thread leases the current snapshot and a request
+     * counts itself in the lease of its thread until its response is written: a lookup takes no lock and touches
+     * no cache line shared with another thread. A replaced snapshot is freed once no lease of it has a request
+     * left, an idle thread does not keep a removed hook alive.
+     */
     class HandlerRegistrar
     {
         friend class Session;
 
         friend class Server;
 
+    public:
+        static constexpr size_t MAX_ROUTE_PARAMS = 16;
+
     private:
         struct HookFunctor
         {
             std::string url;
             HookFunc func{ nullptr };
-            std::vector<std::string> tokens;
+            // Names of the wildcard segments, in path order
+            std::vector<std::string> params;
+            RoutePolicy policy;
+            // Requests of the route in flight, guarded by the admission control of the server
+            mutable size_t inFlight{ 0 };
+            // Owned by the server, outlives the hook
+            RouteMetrics* metrics{ nullptr };
+        };
+
+        // Paths are matched case insensitively without folding the request target
+        struct ILess
+        {
+            using is_transparent = void;
+
+            bool operator()(std::string_view a, std::string_view b) const
+            {
+                return boost::ilexicographical_compare(a, b);
+            }
+        };
+
+        struct RouteNode
+        {
+            std::map<std::string, std::shared_ptr<const RouteNode>, ILess> literals;
+            std::shared_ptr<const RouteNode> param;
+            std::shared_ptr<const HookFunctor> hook;
+        };
+
+        struct RouteTable
+        {
+            std::map<bh::verb, std::shared_ptr<const RouteNode>> roots;
+        };
+
+        using RouteTablePtr = std::shared_ptr<const RouteTable>;
+
+        struct Snapshots;
 
-            HookFunctor() = default;
+        // The snapshot of one version as seen by one thread, only that thread pins requests in it
+        struct Lease
+        {
+            std::shared_ptr<Snapshots> owner;
+            uint64_t version{ 0 };
+            // Valid while the version is current or a request is counted in users
+            const RouteTable* table{ nullptr };
+            std::atomic<size_t> users{ 0 };
+        };
 
-            HookFunctor(const std::string& url_, HookFunc func_)
-                : url(boost::to_lower_copy(url_))
-                , func(std::move(func_))
+        // Shared with the leases, a request may outlive the registrar
+        struct Snapshots
+        {
+            // Serializes writers and the creation of leases, a request never takes it on a leased snapshot
+            std::mutex mutex;
+            std::atomic<uint64_t> version{ 1 };
+            RouteTablePtr current{ std::make_shared<const RouteTable>() };
+            // Replaced snapshots by version, kept while a lease of their version has users
+            std::vector<std::pair<uint64_t, RouteTablePtr>> retired;
+            std::vector<std::weak_ptr<Lease>> leases;
+
+            // Called with the mutex held
+            void publish(RouteTablePtr table)
             {
-                tokens = splitUrl(url);
+                retired.emplace_back(version.load(), std::move(current));
+                current = std::move(table);
+                // Paired with the users check of a request, either the request sees the new version or this sees its user
+                version.fetch_add(1);
+                reclaim();
             }
 
-            bool operator==(const HookFunctor& other) const
+            // Called with the mutex held
+            void reclaim()
             {
-                if (this == &other || url == other.url)
-                {
-                    return true;
-                }
-                if (tokens.size() != other.tokens.size())
-                {
-                    return false;
-                }
-                for (auto i = 0; i < tokens.size(); ++i)
+                std::vector<uint64_t> used;
+                leases.erase(std::remove_if(leases.begin(), leases.end(), [&used](const std::weak_ptr<Lease>& weak)
                 {
-                    auto lt = tokens.at(i);
-                    auto rt = other.tokens.at(i);
-                    if (lt == rt || isFuzzy(lt) && isFuzzy(rt))
+                    auto lease = weak.lock();
+                    if (lease != nullptr && lease->users.load() > 0)
                     {
-                        continue;
+                        used.push_back(lease->version);
                     }
-                    return false;
-                }
-                return true;
+                    return lease == nullptr;
+                }), leases.end());
+                retired.erase(std::remove_if(retired.begin(), retired.end(), [&used](const auto& it)
+                {
+                    return std::find(used.begin(), used.end(), it.first) == used.end();
+                }), retired.end());
+            }
+        };
+
+        // Counts a request in the lease of its thread, moved into the session holding the hook
+        class Pin
+        {
+        public:
+            Pin() = default;
+
+            // Takes over a user already counted in the lease
+            explicit Pin(std::shared_ptr<Lease> lease)
+                : lease_(std::move(lease))
+            {
+
             }
 
-            bool operator<(const HookFunctor& other) const
+            Pin(Pin&& other) noexcept = default;
+
+            Pin& operator=(Pin&& other) noexcept
             {
-                if (*this == other)
+                if (this != &other)
                 {
-                    return false;
+                    release();
+                    lease_ = std::move(other.lease_);
                 }
-                return tokens < other.tokens;
+                return *this;
             }
-        };
 
-        static bool isFuzzy(const std::string& t)
-        {
-            return boost::starts_with(t, "<") && boost::ends_with(t, ">")
-                || boost::starts_with(t, "[") && boost::ends_with(t, "]");
-        }
+            ~Pin()
+            {
+                release();
+            }
 
-        static std::vector<std::string> splitUrl(const std::string& url)
-        {
-            std::vector<std::string> tokens;
-            const std::string& schema = url.substr(0, url.find_first_of('?', 0));
-            boost::split(tokens, boost::to_lower_copy(schema), boost::is_any_of("/"), boost::token_compress_on);
-            for (auto it = tokens.begin(); it != tokens.end();)
+            const RouteTable& table() const
+            {
+                return *lease_->table;
+            }
+
+        private:
+            void release()
             {
-                if (it->empty())
+                if (lease_ == nullptr)
                 {
-                    it = tokens.erase(it);
+                    return;
                 }
-                else
+                auto& owner = *lease_->owner;
+                // The last user of a replaced snapshot frees it
+                if (lease_->users.fetch_sub(1) == 1 && owner.version.load() != lease_->version)
                 {
-                    ++it;
+                    std::lock_guard<std::mutex> lock(owner.mutex);
+                    owner.reclaim();
                 }
+                lease_.reset();
             }
-            return tokens;
-        }
+
+        private:
+            std::shared_ptr<Lease> lease_;
+        };
 
         struct MatchedResult
         {
-            bool ok{ false };
-            HookFunctor func;
-            std::map<std::string, std::string> args;
+            const RouteNode* node{ nullptr };
+            int weight{ 0 };
+            std::array<std::string_view, MAX_ROUTE_PARAMS> args;
         };
 
-        static MatchedResult match(const std::string& schema, const std::set<HookFunctor>& funcs)
+        static bool isFuzzy(std::string_view t)
+        {
+            return t.size() >= 2 && ((t.front() == '<' && t.back() == '>') || (t.front() == '[' && t.back() == ']'));
+        }
+
+        // Pops the next non empty segment of the path, empty once the path is consumed
+        static std::string_view nextSegment(std::string_view& path)
+        {
+            auto begin = path.find_first_not_of('/');
+            if (begin == std::string_view::npos)
+            {
+                path = std::string_view();
+                return path;
+            }
+            auto end = path.find('/', begin);
+            auto segment = path.substr(begin, end == std::string_view::npos ? std::string_view::npos : end - begin);
+            path = end == std::string_view::npos ? std::string_view() : path.substr(end);
+            return segment;
+        }
+
+        // Depth first, literal before wildcard, captures are views of the request path
+        static void match(const RouteNode& node, std::string_view path, int weight, size_t depth,
+                          std::array<std::string_view, MAX_ROUTE_PARAMS>& captures, MatchedResult& best)
         {
-            bool fuzzy = boost::contains(schema, "<") || boost::contains(schema, ">")
-                || boost::contains(schema, "[") || boost::contains(schema, "]");
-            if (fuzzy)
+            if (node.hook != nullptr && weight > best.weight)
+            {
+                best.node = &node;
+                best.weight = weight;
+                std::copy_n(captures.begin(), depth, best.args.begin());
+            }
+            auto segment = nextSegment(path);
+            if (segment.empty())
+            {
+                return;
+            }
+            // Only a segment with escapes is copied, to look its literal up decoded
+            auto it = segment.find('%') == std::string_view::npos ? node.literals.find(segment) : node.literals.find(percentDecode(segment));
+            if (it != node.literals.end())
+            {
+                match(*it->second, path, weight + 100, depth, captures, best);
+            }
+            if (node.param != nullptr && depth < MAX_ROUTE_PARAMS)
             {
-                return MatchedResult();
+                captures[depth] = segment;
+                match(*node.param, path, weight + 10, depth + 1, captures, best);
             }
+        }
 
-            const std::vector<std::string>& tokens = splitUrl(schema);
-            int computedWeight = 0;
-            MatchedResult computed{ false };
-            for (auto f : funcs)
+        // Copies the nodes along the path, the rest is shared with the previous snapshot, null on duplicate
+        static std::shared_ptr<RouteNode> insert(const RouteNode* node, std::string_view path, const std::shared_ptr<const HookFunctor>& hook)
+        {
+            auto copy = node != nullptr ? std::make_shared<RouteNode>(*node) : std::make_shared<RouteNode>();
+            auto segment = nextSegment(path);
+            if (segment.empty())
             {
-                if (tokens.size() < f.tokens.size())
+                if (copy->hook != nullptr)
                 {
-                    continue;
+                    return nullptr;
+                }
+                copy->hook = hook;
+                return copy;
+            }
+            if (isFuzzy(segment))
+            {
+                auto child = insert(copy->param.get(), path, hook);
+                if (child == nullptr)
+                {
+                    return nullptr;
                 }
+                copy->param = std::move(child);
+                return copy;
+            }
+            auto it = copy->literals.find(segment);
+            auto child = insert(it == copy->literals.end() ? nullptr : it->second.get(), path, hook);
+            if (child == nullptr)
+            {
+                return nullptr;
+            }
+            if (it == copy->literals.end())
+            {
+                copy->literals.emplace(std::string(segment), std::move(child));
+            }
+            else
+            {
+                it->second = std::move(child);
+            }
+            return copy;
+        }
 
-                std::map<std::string, std::string> args;
-                int weight = 0;
-                if (f.tokens.empty())
+        // Returns the node without the route, null once nothing is left below it
+        static std::shared_ptr<const RouteNode> erase(const std::shared_ptr<const RouteNode>& node, std::string_view path, bool& removed)
+        {
+            auto segment = nextSegment(path);
+            auto copy = std::make_shared<RouteNode>(*node);
+            if (segment.empty())
+            {
+                removed = copy->hook != nullptr;
+                copy->hook.reset();
+            }
+            else if (isFuzzy(segment))
+            {
+                if (copy->param != nullptr)
                 {
-                    weight += 1;
+                    copy->param = erase(copy->param, path, removed);
                 }
-                else
+            }
+            else
+            {
+                auto it = copy->literals.find(segment);
+                if (it != copy->literals.end())
                 {
-                    for (auto i = 0; i < f.tokens.size(); ++i)
+                    auto child = erase(it->second, path, removed);
+                    if (child == nullptr)
                     {
-                        auto ft = f.tokens.at(i);
-                        auto st = tokens.at(i);
-                        if (ft == st)
-                        {
-                            weight += 100;
-                        }
-                        else if (isFuzzy(ft))
-                        {
-                            auto name = ft.substr(1, ft.size() - 2);
-                            args[name] = st;
-                            weight += 10;
-                        }
-                        else
-                        {
-                            break;
-                        }
+                        copy->literals.erase(it);
+                    }
+                    else
+                    {
+                        it->second = std::move(child);
                     }
                 }
-                if (weight > computedWeight)
-                {
-                    computedWeight = weight;
-                    computed = MatchedResult{ true, f, args };
-                }
             }
-            return computed;
+            if (!removed)
+            {
+                return node;
+            }
+            if (copy->hook == nullptr && copy->param == nullptr && copy->literals.empty())
+            {
+                return nullptr;
+            }
+            return copy;
+        }
+
+        template<typename Func>
+        static void visit(const RouteNode& node, const Func& func)
+        {
+            if (node.hook != nullptr)
+            {
+                func(*node.hook);
+            }
+            for (const auto& it : node.literals)
+            {
+                visit(*it.second, func);
+            }
+            if (node.param != nullptr)
+            {
+                visit(*node.param, func);
+            }
         }
 
     public:
+        HandlerRegistrar()
+            : snapshots_(std::make_shared<Snapshots>())
+        {
+
+        }
+
         ~HandlerRegistrar()
         {
-            hooks_.clear();
+            // The leases cached by the io threads outlive the registrar, its routes must not
+            std::lock_guard<std::mutex> lock(snapshots_->mutex);
+            snapshots_->publish(nullptr);
         }
 
     public:
-        inline bool add(boost::beast::http::verb verb, const std::string& target, const HookFunc& func);
+        inline bool add(boost::beast::http::verb verb, const std::string& target, const HookFunc& func, const RoutePolicy& policy = {}, MetricsRegistry* metrics = nullptr);
+        inline bool remove(boost::beast::http::verb verb, const std::string& target);
+
+        // Registered routes ordered by verb then path
+        std::vector<std::pair<bh::verb, std::string>> routes() const
+        {
+            std::vector<std::pair<bh::verb, std::string>> routes;
+            RouteTablePtr table;
+            {
+                std::lock_guard<std::mutex> lock(snapshots_->mutex);
+                table = snapshots_->current;
+            }
+            for (const auto& it : table->roots)
+            {
+                visit(*it.second, [&](const HookFunctor& hook)
+                {
+                    routes.emplace_back(it.first, hook.url);
+                });
+            }
+            return routes;
+        }
 
     private:
-        bool process(const SessionPtr& session);
+        // Binds the route params to the session, which pins the table of its hook
+        const HookFunctor* find(Session& session);
+
+        // Counts the request in the lease of the calling thread, a new lease is only taken once the version changed.
+        // A thread keeps one lease per registrar it serves, the stale ones of other registrars are dropped on the way
+        Pin pin()
+        {
+            thread_local std::vector<std::shared_ptr<Lease>> cached;
+            auto it = cached.begin();
+            while (it != cached.end() && (*it)->owner != snapshots_)
+            {
+                const auto& other = **it;
+                if (other.users.load() == 0 && other.owner->version.load() != other.version)
+                {
+                    it = cached.erase(it);
+                    continue;
+                }
+                ++it;
+            }
+            if (it == cached.end())
+            {
+                it = cached.insert(it, lease());
+            }
+            while (true)
+            {
+                auto& lease = *it;
+                lease->users.fetch_add(1);
+                Pin pinned(lease);
+                if (snapshots_->version.load() == lease->version)
+                {
+                    return pinned;
+                }
+                lease = this->lease();
+            }
+        }
+
+        std::shared_ptr<Lease> lease()
+        {
+            auto lease = std::make_shared<Lease>();
+            lease->owner = snapshots_;
+            std::lock_guard<std::mutex> lock(snapshots_->mutex);
+            // Leases of the threads that ended or moved on, reclaim only trims them on publish
+            snapshots_->leases.erase(std::remove_if(snapshots_->leases.begin(), snapshots_->leases.end(), [](const std::weak_ptr<Lease>& weak)
+            {
+                return weak.expired();
+            }), snapshots_->leases.end());
+            lease->version = snapshots_->version.load();
+            lease->table = snapshots_->current.get();
+            snapshots_->leases.emplace_back(lease);
+            return lease;
+        }
 
     private:
-        std::mutex mutex_;
-        std::map<boost::beast::http::verb, std::set<HookFunctor>> hooks_;
+        std::shared_ptr<Snapshots> snapshots_;
     };
 
     using HandlerRegistrarPtr = std::shared_ptr<HandlerRegistrar>;
@@ -329,163 +679,562 @@ namespace http
     /************************************************************************/
     /* SendLambda                                                           */
     /************************************************************************/
+    // Keeps the response of a handler, the connection coroutine writes it once the handler returned
     struct SendLambda
     {
-        beast::tcp_stream& stream_;
-        bool& close_;
-        beast::error_code& ec_;
-        net::yield_context yield_;
-
-        SendLambda(beast::tcp_stream& stream, bool& close, beast::error_code& ec, net::yield_context yield)
-            : stream_(stream)
-            , close_(close)
-            , ec_(ec)
-            , yield_(std::move(yield))
+        // A part of a file response, prefix is written before the bytes, a multipart boundary for example
+        struct FileSlice
         {
-
-        }
+            std::string prefix;
+            uint64_t offset{ 0 };
+            uint64_t length{ 0 };
+        };
 
         template<bool isRequest, class Body, class Fields>
-        void operator()(bh::message<isRequest, Body, Fields>&& msg) const
+        void operator()(bh::message<isRequest, Body, Fields>&& msg)
         {
             // Determine if we should close the connection after
             close_ = msg.need_eof();
-
-            // We need the serializer here because the serializer requires
-            // a non-const file_body, and the message oriented version of
-            // http::write only works with const messages.
-            bh::serializer<isRequest, Body, Fields> sr{ msg };
-            bh::async_write(stream_, sr, yield_[ec_]);
+            writer_ = std::make_unique<MessageWriter<isRequest, Body, Fields>>(std::move(msg));
         }
-    };
-
-    /************************************************************************/
-    /* WebSocketGroupHandler                                                */
-    /************************************************************************/
-    class WebSocketGroupHandler
-    {
-    public:
-        WebSocketGroupHandler()
-        = default;
 
-        ~WebSocketGroupHandler()
+        // The header content length covers every slice
+        template<class Fields>
+        void sendFile(bh::response<bh::empty_body, Fields>&& header, beast::file&& file, std::vector<FileSlice>&& slices)
         {
-            for (const auto& it : clients_)
-            {
-                for (const auto& c : it.second)
-                {
-                    boost::system::error_code ec;
-                    c->close(websocket::close_reason("Server shutdown"), ec);
-                }
-            }
+            close_ = header.need_eof();
+            writer_ = std::make_unique<FileWriter<Fields>>(std::move(header), std::move(file), std::move(slices));
         }
 
-    public:
-        void handle(const bh::request<bh::string_body>& req, beast::tcp_stream& stream, beast::error_code& ec, const net::yield_context& yield)
+        // A write making no progress for the timeout fails with beast::error::timeout, 0 waits forever
+        net::awaitable<void> flush(beast::tcp_stream& stream, std::chrono::seconds timeout, beast::error_code& ec)
         {
-            auto wstream = std::make_shared<ws_stream>(std::move(stream));
-            wstream->set_option(websocket::stream_base::timeout::suggested(beast::role_type::server));
-            wstream->set_option(websocket::stream_base::decorator([](websocket::response_type& res)
-            {
-                res.set(bh::field::server, WEBSOCKET_SERVER_VERSION);
-            }));
-
-            wstream->async_accept(req, yield[ec]);
-            if (ec)
+            if (writer_ == nullptr)
             {
-                LOG_ERROR("Accept failed, {}", ec.message());
-                return;
+                co_return;
             }
-
-            std::string group{ req.target().to_string() };
-            boost::to_lower(group);
-            join(wstream, group);
-
-            for (;;)
+            auto writer = std::move(writer_);
+            co_await writer->write(stream, timeout, ec);
+            if (ec)
             {
-                if (!wstream->is_open())
-                {
-                    return;
-                }
-                beast::flat_buffer buffer;
-                wstream->async_read(buffer, yield[ec]);
-                if (ec == websocket::error::closed)
-                {
-                    LOG_WARN("{}", ec.message());
-                    return;
-                }
-
-                multicastMessage(wstream, group, buffer, ec, yield);
+                close_ = true;
             }
         }
 
+        bool close_{ false };
+
     private:
-        void join(const ws_stream_ptr& stream, const std::string& group)
+        struct Writer
         {
-            if (group.empty())
-            {
-                return;
-            }
-            std::lock_guard<std::mutex> lock(mutex_);
-            clients_[group].insert(stream);
-        }
+            virtual ~Writer() = default;
+            virtual net::awaitable<void> write(beast::tcp_stream& stream, std::chrono::seconds timeout, beast::error_code& ec) = 0;
+        };
 
-        void exit(const ws_stream_ptr& stream, const std::string& group)
+        template<bool isRequest, class Body, class Fields>
+        struct MessageWriter final : Writer
         {
-            if (group.empty())
+            explicit MessageWriter(bh::message<isRequest, Body, Fields>&& msg)
+                : msg_(std::move(msg))
             {
-                return;
+
             }
-            std::lock_guard<std::mutex> lock(mutex_);
-            clients_[group].erase(stream);
-        }
 
-        void multicastMessage(const ws_stream_ptr& stream, const std::string& group, beast::flat_buffer& message, beast::error_code& ec, const net::yield_context& yield)
-        {
-            if (clients_.count(group) == 0)
+            // Bounded by the expiry the connection set for the request
+            net::awaitable<void> write(beast::tcp_stream& stream, std::chrono::seconds, beast::error_code& ec) override
             {
-                LOG_WARN("Group not exist, group={}", group);
-                return;
+                // We need the serializer here because the serializer requires
+                // a non-const file_body, and the message oriented version of
+                // http::write only works with const messages.
+                bh::serializer<isRequest, Body, Fields> sr{ msg_ };
+                co_await bh::async_write(stream, sr, net::redirect_error(net::use_awaitable, ec));
             }
-            std::set<ws_stream_ptr> clients;
+
+            bh::message<isRequest, Body, Fields> msg_;
+        };
+
+        template<class Fields>
+        struct FileWriter final : Writer
+        {
+            FileWriter(bh::response<bh::empty_body, Fields>&& header, beast::file&& file, std::vector<FileSlice>&& slices)
+                : header_(std::move(header))
+                , file_(std::move(file))
+                , slices_(std::move(slices))
             {
-                std::lock_guard<std::mutex> lock(mutex_);
-                clients = clients_.at(group);
+
             }
 
-            std::list<ws_stream_ptr> closed;
-            for (const auto& c : clients)
+            // A download may take longer than the request timeout, each write is given the whole timeout instead
+            net::awaitable<void> write(beast::tcp_stream& stream, std::chrono::seconds timeout, beast::error_code& ec) override
             {
-                if (c == stream)
-                {
-                    continue;
-                }
-                if (!c->is_open())
-                {
-                    closed.push_back(c);
-                    continue;
-                }
-                c->text(stream->got_text());
-                c->async_write(message.data(), yield[ec]);
-                if (ec)
+                timeout_ = timeout;
+                bh::response_serializer<bh::empty_body, Fields> sr{ header_ };
+                expire(stream);
+                co_await bh::async_write_header(stream, sr, net::redirect_error(net::use_awaitable, ec));
+                for (auto it = slices_.begin(); it != slices_.end() && !ec; ++it)
                 {
-                    LOG_ERROR("Write failed, {}", ec.message());
-                    break;
+                    if (!it->prefix.empty())
+                    {
+                        expire(stream);
+                        co_await net::async_write(stream, net::buffer(it->prefix), net::redirect_error(net::use_awaitable, ec));
+                    }
+                    if (!ec && it->length > 0)
+                    {
+                        co_await copyFile(stream, it->offset, it->length, ec);
+                    }
                 }
             }
 
+            void expire(beast::tcp_stream& stream) const
             {
-                std::lock_guard<std::mutex> lock(mutex_);
-                for (const auto& c : closed)
+                if (timeout_.count() > 0)
                 {
-                    clients_[group].erase(c);
+                    stream.expires_after(timeout_);
                 }
             }
+
+#ifdef __linux__
+            // The kernel copies from the page cache to the socket, the coroutine waits on EAGAIN
+            net::awaitable<void> copyFile(beast::tcp_stream& stream, uint64_t offset, uint64_t length, beast::error_code& ec)
+            {
+                auto& socket = stream.socket();
+                socket.native_non_blocking(true, ec);
+                auto off = (off_t)offset;
+                while (length > 0 && !ec)
+                {
+                    auto n = ::sendfile(socket.native_handle(), file_.native_handle(), &off, (size_t)std::min<uint64_t>(length, 1u << 30));
+                    if (n > 0)
+                    {
+                        length -= n;
+                        continue;
+                    }
+                    if (n < 0 && errno == EINTR)
+                    {
+                        continue;
+                    }
+                    if (n < 0 && (errno == EAGAIN || errno == EWOULDBLOCK))
+                    {
+                        co_await waitWritable(stream, ec);
+                        continue;
+                    }
+                    ec = n < 0 ? beast::error_code(errno, boost::system::system_category()) : bh::error::partial_message;
+                }
+            }
+
+            // The wait bypasses the expiry of the stream, a timer cancels it once the client read nothing for the timeout
+            net::awaitable<void> waitWritable(beast::tcp_stream& stream, beast::error_code& ec)
+            {
+                net::steady_timer timer(co_await net::this_coro::executor);
+                // A timer that fired as the socket became writable must not cancel the next operation
+                auto waiting = std::make_shared<bool>(true);
+                if (timeout_.count() > 0)
+                {
+                    timer.expires_after(timeout_);
+                    timer.async_wait([waiting, &stream](const beast::error_code& e)
+                    {
+                        if (!e && *waiting)
+                        {
+                            stream.socket().cancel();
+                        }
+                    });
+                }
+                co_await stream.socket().async_wait(tcp::socket::wait_write, net::redirect_error(net::use_awaitable, ec));
+                *waiting = false;
+                if (ec == net::error::operation_aborted)
+                {
+                    ec = beast::error::timeout;
+                }
+            }
+#else
+            net::awaitable<void> copyFile(beast::tcp_stream& stream, uint64_t offset, uint64_t length, beast::error_code& ec)
+            {
+                std::vector<char> buffer(64 * 1024);
+                file_.seek(offset, ec);
+                while (length > 0 && !ec)
+                {
+                    auto n = file_.read(buffer.data(), (size_t)std::min<uint64_t>(length, buffer.size()), ec);
+                    if (ec || n == 0)
+                    {
+                        ec = ec ? ec : bh::error::partial_message;
+                        break;
+                    }
+                    expire(stream);
+                    co_await net::async_write(stream, net::buffer(buffer.data(), n), net::redirect_error(net::use_awaitable, ec));
+                    length -= n;
+                }
+            }
+#endif
+
+            bh::response<bh::empty_body, Fields> header_;
+            beast::file file_;
+            std::vector<FileSlice> slices_;
+            std::chrono::seconds timeout_{ 0 };
+        };
+
+        std::unique_ptr<Writer> writer_;
+    };
+
+    /************************************************************************/
+    /* WebSocketGroupHandler                                                */
+    /************************************************************************/
+    // What a WebSocket client whose send queue is full loses
+    enum SlowConsumerPolicy : uint8_t
+    {
+        // Its oldest queued messages
+        SLOW_DROP_OLDEST,
+        // Its connection
+        SLOW_DISCONNECT,
+        // Every queued message but the newest, for feeds where only the latest state matters
+        SLOW_COALESCE,
+    };
+
+    struct WebSocketPolicy
+    {
+        // Messages queued for a client and not yet written, 0 is unlimited
+        size_t maxQueue{ 256 };
+        size_t maxQueueBytes{ 4 * 1024 * 1024 };
+        SlowConsumerPolicy slowConsumer{ SLOW_DROP_OLDEST };
+        // Compression offered to the client, every client compresses with a window of its own
+        ws::DeflateOptions deflate;
+    };
+
+    /**
+     * Relays the messages of a WebSocket client to the other clients of its group, the target of the upgrade request.
+     * Every client has a bounded send queue drained by a writer coroutine of its own, a sender only queues the message,
+     * so a slow client never stalls its group. Groups are spread over lock-striped shards and hold their subscribers in
+     * a copy-on-write snapshot, a broadcast takes no registry lock, only the mutex of its group for a pointer copy.
+     */
+    class WebSocketGroupHandler
+    {
+    public:
+        // Picks the policy of a client from its upgrade request
+        using PolicySelector = std::function<WebSocketPolicy(const bh::request<bh::string_body>&)>;
+
+        // A broadcast message, referenced by the send queue of every client instead of copied
+        struct Frame
+        {
+            std::string payload;
+            bool text{ true };
+        };
+
+        using FramePtr = std::shared_ptr<const Frame>;
+
+        struct Stats
+        {
+            size_t clients{ 0 };
+            uint64_t dropped{ 0 };
+            uint64_t coalesced{ 0 };
+            uint64_t disconnected{ 0 };
+        };
+
+    public:
+        WebSocketGroupHandler()
+        = default;
+
+    public:
+        // Call this method before serving
+        void setPolicy(PolicySelector select)
+        {
+            select_ = std::move(select);
+        }
+
+        [[nodiscard]] Stats stats() const
+        {
+            return Stats{ clients_.load(), dropped_.load(), coalesced_.load(), disconnected_.load() };
+        }
+
+        // Queues the frame for every client of the group, returns how many
+        size_t publish(const std::string& group, const FramePtr& frame)
+        {
+            const auto name = boost::to_lower_copy(group);
+            GroupPtr g;
+            {
+                auto& shard = shardOf(name);
+                std::lock_guard<std::mutex> lock(shard.mutex);
+                auto it = shard.groups.find(name);
+                if (it == shard.groups.end())
+                {
+                    return 0;
+                }
+                g = it->second;
+            }
+            return fanOut(*g, frame, nullptr);
+        }
+
+        net::awaitable<void> handle(const bh::request<bh::string_body>& req, beast::tcp_stream& stream, beast::error_code& ec)
+        {
+            // The reader and the writer of a client share the stream, they run on one strand
+            auto strand = net::make_strand(stream.get_executor());
+            auto client = std::make_shared<Client>(std::move(stream), strand, select_ ? select_(req) : WebSocketPolicy{});
+            co_await net::co_spawn(strand, serve(req, client, ec), net::use_awaitable);
         }
 
     private:
-        std::mutex mutex_;
-        std::unordered_map<std::string, std::set<ws_stream_ptr>> clients_;
+        struct Client
+        {
+            Client(beast::tcp_stream&& s, net::strand<net::any_io_executor> st, const WebSocketPolicy& p)
+                : stream(std::move(s))
+                , strand(std::move(st))
+                , policy(p)
+            {
+
+            }
+
+            ws_stream stream;
+            net::strand<net::any_io_executor> strand;
+            const WebSocketPolicy policy;
+
+            std::mutex mutex;
+            std::deque<FramePtr> queue;
+            size_t queueBytes{ 0 };
+            bool writing{ false };
+            bool closed{ false };
+        };
+
+        using ClientPtr = std::shared_ptr<Client>;
+        using Subscribers = std::shared_ptr<const std::vector<ClientPtr>>;
+
+        // The subscribers are replaced whole by every join and exit under the shard mutex, a broadcast copies the current ones
+        struct Group
+        {
+            explicit Group(std::string n)
+                : name(std::move(n))
+            {
+
+            }
+
+            Subscribers snapshot() const
+            {
+                std::lock_guard<std::mutex> lock(mutex);
+                return subscribers;
+            }
+
+            void publish(Subscribers next)
+            {
+                std::lock_guard<std::mutex> lock(mutex);
+                subscribers.swap(next);
+            }
+
+            const std::string name;
+            // Guards the pointer only, never held while a snapshot is walked
+            mutable std::mutex mutex;
+            Subscribers subscribers{ std::make_shared<const std::vector<ClientPtr>>() };
+        };
+
+        using GroupPtr = std::shared_ptr<Group>;
+
+        static constexpr size_t SHARD_COUNT = 64;
+
+        // Padded so the mutexes of neighbouring shards do not share a cache line
+        struct alignas(64) Shard
+        {
+            std::mutex mutex;
+            std::unordered_map<std::string, GroupPtr> groups;
+        };
+
+        net::awaitable<void> serve(const bh::request<bh::string_body>& req, ClientPtr client, beast::error_code& ec)
+        {
+            auto& wstream = client->stream;
+            // The websocket timeouts replace the one of the HTTP connection
+            beast::get_lowest_layer(wstream).expires_never();
+            // A shared frame goes out whole, a header and one gather write, instead of a write per 4 KiB fragment
+            wstream.auto_fragment(false);
+            ws::setDeflate(wstream, client->policy.deflate);
+            wstream.set_option(websocket::stream_base::timeout::suggested(beast::role_type::server));
+            wstream.set_option(websocket::stream_base::decorator([](websocket::response_type& res)
+            {
+                res.set(bh::field::server, WEBSOCKET_SERVER_VERSION);
+            }));
+
+            co_await wstream.async_accept(req, net::redirect_error(net::use_awaitable, ec));
+            if (ec)
+            {
+                LOG_ERROR("Accept failed, {}", ec.message());
+                co_return;
+            }
+
+            std::string group{ req.target().to_string() };
+            boost::to_lower(group);
+            // Held for the life of the client, its messages find the group without a lookup
+            const auto g = join(client, group);
+
+            beast::flat_buffer buffer;
+            for (;;)
+            {
+                buffer.clear();
+                co_await wstream.async_read(buffer, net::redirect_error(net::use_awaitable, ec));
+                if (ec)
+                {
+                    LOG_WARN("{}", ec.message());
+                    break;
+                }
+                multicastMessage(client, g.get(), buffer);
+            }
+            exit(client, g);
+        }
+
+        Shard& shardOf(const std::string& group)
+        {
+            return shards_[std::hash<std::string>{}(group) % SHARD_COUNT];
+        }
+
+        GroupPtr join(const ClientPtr& client, const std::string& group)
+        {
+            if (group.empty())
+            {
+                return nullptr;
+            }
+            auto& shard = shardOf(group);
+            std::lock_guard<std::mutex> lock(shard.mutex);
+            auto& g = shard.groups[group];
+            if (g == nullptr)
+            {
+                g = std::make_shared<Group>(group);
+            }
+            auto subscribers = std::make_shared<std::vector<ClientPtr>>(*g->snapshot());
+            subscribers->push_back(client);
+            g->publish(std::move(subscribers));
+            clients_ += 1;
+            return g;
+        }
+
+        void exit(const ClientPtr& client, const GroupPtr& g)
+        {
+            if (g != nullptr)
+            {
+                auto& shard = shardOf(g->name);
+                std::lock_guard<std::mutex> lock(shard.mutex);
+                auto subscribers = std::make_shared<std::vector<ClientPtr>>(*g->snapshot());
+                std::erase(*subscribers, client);
+                // A client joining later creates the group again, the one held by a broadcast in flight stays valid
+                if (subscribers->empty())
+                {
+                    shard.groups.erase(g->name);
+                }
+                g->publish(std::move(subscribers));
+                clients_ -= 1;
+            }
+            std::lock_guard<std::mutex> clock(client->mutex);
+            client->closed = true;
+            client->queue.clear();
+        }
+
+        // Copies the message once, every other client of the group queues a reference to it
+        void multicastMessage(const ClientPtr& sender, const Group* g, const beast::flat_buffer& buffer)
+        {
+            if (g == nullptr)
+            {
+                return;
+            }
+            auto frame = std::make_shared<const Frame>(Frame{ beast::buffers_to_string(buffer.data()), sender->stream.got_text() });
+            fanOut(*g, frame, sender.get());
+        }
+
+        // Runs on a snapshot, clients joining meanwhile miss this frame and ones leaving drop it
+        size_t fanOut(const Group& g, const FramePtr& frame, const Client* sender)
+        {
+            const auto subscribers = g.snapshot();
+            size_t count = 0;
+            for (const auto& c : *subscribers)
+            {
+                if (c.get() != sender)
+                {
+                    send(c, frame);
+                    count += 1;
+                }
+            }
+            return count;
+        }
+
+        void send(const ClientPtr& c, const FramePtr& frame)
+        {
+            std::unique_lock<std::mutex> lock(c->mutex);
+            if (c->closed)
+            {
+                return;
+            }
+            const auto& policy = c->policy;
+            auto full = [&]
+            {
+                return !c->queue.empty()
+                    && ((policy.maxQueue > 0 && c->queue.size() >= policy.maxQueue)
+                        || (policy.maxQueueBytes > 0 && c->queueBytes + frame->payload.size() > policy.maxQueueBytes));
+            };
+            if (full() && policy.slowConsumer == SLOW_DISCONNECT)
+            {
+                c->closed = true;
+                c->queue.clear();
+                lock.unlock();
+                disconnected_ += 1;
+                // A write stuck on a full socket buffer is aborted too
+                net::post(c->strand, [c]
+                {
+                    beast::get_lowest_layer(c->stream).close();
+                });
+                return;
+            }
+            if (full() && policy.slowConsumer == SLOW_COALESCE)
+            {
+                coalesced_ += c->queue.size();
+                c->queue.clear();
+                c->queueBytes = 0;
+            }
+            while (full())
+            {
+                c->queueBytes -= c->queue.front()->payload.size();
+                c->queue.pop_front();
+                dropped_ += 1;
+            }
+            c->queue.push_back(frame);
+            c->queueBytes += frame->payload.size();
+            if (!c->writing)
+            {
+                c->writing = true;
+                lock.unlock();
+                net::co_spawn(c->strand, drain(c), net::detached);
+            }
+        }
+
+        // Writes the queue of a client until it is empty, spawned again by the next message
+        static net::awaitable<void> drain(ClientPtr c)
+        {
+            beast::error_code ec;
+            for (;;)
+            {
+                FramePtr frame;
+                {
+                    std::lock_guard<std::mutex> lock(c->mutex);
+                    if (c->queue.empty() || c->closed)
+                    {
+                        c->writing = false;
+                        co_return;
+                    }
+                    frame = std::move(c->queue.front());
+                    c->queue.pop_front();
+                    c->queueBytes -= frame->payload.size();
+                }
+                c->stream.text(frame->text);
+                ws::compressNext(c->stream, c->policy.deflate, frame->payload.size());
+                co_await c->stream.async_write(net::buffer(frame->payload), net::redirect_error(net::use_awaitable, ec));
+                if (ec)
+                {
+                    // The reader fails too and takes the client out of its group
+                    LOG_ERROR("Write failed, {}", ec.message());
+                    std::lock_guard<std::mutex> lock(c->mutex);
+                    c->closed = true;
+                    c->queue.clear();
+                    c->writing = false;
+                    co_return;
+                }
+            }
+        }
+
+    private:
+        PolicySelector select_{ nullptr };
+        std::array<Shard, SHARD_COUNT> shards_;
+        std::atomic<size_t> clients_{ 0 };
+        std::atomic<uint64_t> dropped_{ 0 };
+        std::atomic<uint64_t> coalesced_{ 0 };
+        std::atomic<uint64_t> disconnected_{ 0 };
     };
 
 
@@ -499,12 +1248,20 @@ namespace http
         friend class HandlerRegistrar;
 
     public:
-        Session(std::string root, bh::request<bh::string_body>&& req, SendLambda&& send)
+        Session(std::string root, bh::request<bh::string_body>&& req)
             : root_(std::move(root))
-            , req_(req)
-            , send_(send)
+            , req_(std::move(req))
         {
-            href_ = decodeUri(req_.target());
+
+        }
+
+        ~Session()
+        {
+            if (!bodyFile_.empty())
+            {
+                std::error_code ec;
+                std::filesystem::remove(bodyFile_, ec);
+            }
         }
 
     public:
@@ -518,9 +1275,17 @@ namespace http
             return req_.method_string().to_string();
         }
 
+        // Decoded on each call, prefer path on hot paths
         std::string href() const
         {
-            return href_;
+            return percentDecode(std::string_view(req_.target().data(), req_.target().size()));
+        }
+
+        // The raw path of the target without its query, a view into the request
+        std::string_view path() const
+        {
+            std::string_view target(req_.target().data(), req_.target().size());
+            return target.substr(0, target.find_first_of("?#"));
         }
 
         std::string requestBody() const
@@ -528,23 +1293,48 @@ namespace http
             return req_.body();
         }
 
-        std::string arg(const std::string& key, const std::string& value = "") const
+        // The spooled body of a BODY_SPOOLED route, removed with the session unless the hook moved it away
+        const std::string& bodyFile() const
         {
-            auto k = boost::to_lower_copy(key);
-            return args_.count(k) > 0 ? args_.at(k) : value;
+            return bodyFile_;
         }
 
-        std::map<std::string, std::string> args() const
+        // Keys are case insensitive, a route param overrides a query argument of the same name
+        std::string arg(std::string_view key, const std::string& value = "") const
+        {
+            auto a = findArgument(key);
+            return a == nullptr ? value : a->decoded();
+        }
+
+        // The raw value without decoding, valid as long as the session
+        std::string_view argView(std::string_view key, std::string_view value = {}) const
+        {
+            auto a = findArgument(key);
+            return a == nullptr ? value : a->value;
+        }
+
+        const Arguments& arguments() const
         {
             return args_;
         }
 
+        // Decoded copy with lower case keys, prefer arg or arguments on hot paths
+        std::map<std::string, std::string> args() const
+        {
+            std::map<std::string, std::string> args;
+            for (const auto& a : args_)
+            {
+                args[boost::to_lower_copy(a.decodedKey())] = a.decoded();
+            }
+            return args;
+        }
+
         int responseCode() const
         {
             return repStatusCode_;
         }
 
-        int responseContentLength() const
+        uint64_t responseContentLength() const
         {
             return repContentLen_;
         }
@@ -552,15 +1342,33 @@ namespace http
         template<typename Body>
         void reply(bh::response<Body>& rep)
         {
-            BOOST_ASSERT_MSG(!replied_, "Duplicate reply");
-            if (replied_)
+            if (!claim())
             {
                 return;
             }
-            replied_ = true;
             repStatusCode_ = (int)rep.result();
-            repContentLen_ = (int)rep.payload_size().get();
-            return send_(std::move(rep));
+            repContentLen_ = rep.payload_size().value_or(0);
+            send_(std::move(rep));
+            staged();
+        }
+
+        // Header then file bytes straight from the kernel, the header content length covers every slice.
+        // The file is taken over and written after the handler returned
+        void replyFile(bh::response<bh::empty_body>& header, beast::file& file, std::vector<SendLambda::FileSlice> slices)
+        {
+            if (!claim())
+            {
+                return;
+            }
+            repStatusCode_ = (int)header.result();
+            // An empty_body has no payload of its own, the slices are what gets written
+            repContentLen_ = 0;
+            for (const auto& slice : slices)
+            {
+                repContentLen_ += slice.prefix.size() + slice.length;
+            }
+            send_.sendFile(std::move(header), std::move(file), std::move(slices));
+            staged();
         }
 
         template<ResponseContextType type = DEFAULT>
@@ -583,9 +1391,26 @@ namespace http
 
         void replyLocalFile(const std::string& path, std::string name = "")
         {
+            // Ranges are served from the file, the cache only keeps whole bodies
+            const bool ranged = req_.count(bh::field::range) > 0;
+            if (cache_ != nullptr && !ranged && (req_.method() == bh::verb::get || req_.method() == bh::verb::head))
+            {
+                std::error_code cec;
+                auto mtype = minetype(path);
+                auto entry = cache_->get(path, std::string_view(mtype.data(), mtype.size()), cec);
+                if (entry != nullptr)
+                {
+                    return replyCachedFile(path, entry, std::move(name));
+                }
+                if (cec == std::errc::no_such_file_or_directory)
+                {
+                    return replyNotFound();
+                }
+            }
+
             boost::beast::error_code ec;
-            bh::file_body::value_type body;
-            body.open(path.c_str(), boost::beast::file_mode::scan, ec);
+            beast::file file;
+            file.open(path.c_str(), boost::beast::file_mode::scan, ec);
 
             if (ec == boost::system::errc::no_such_file_or_directory)
             {
@@ -597,28 +1422,139 @@ namespace http
                 return replyServerError(ec.message());
             }
 
+            const auto size = file.size(ec);
+            std::error_code fec;
+            const auto etag = StaticFileCache::makeEtag(size, std::filesystem::last_write_time(path, fec));
+            bh::response<bh::empty_body> res{ bh::status::ok, req_.version() };
+            res.set(bh::field::server, HTTP_SERVER_VERSION);
+            res.set(bh::field::etag, etag);
+            res.set(bh::field::accept_ranges, "bytes");
+            res.keep_alive(req_.keep_alive());
+
+            if (matchEtag(req_[bh::field::if_none_match], etag))
+            {
+                res.result(bh::status::not_modified);
+                return reply(res);
+            }
+
+            auto mtype = minetype(path);
+            res.set(bh::field::content_type, mtype);
+            if (mtype.empty() && path.rfind('/') != std::string::npos)
+            {
+                if (name.empty())
+                {
+                    name = path.substr(path.rfind('/') + 1);
+                }
+                res.set(bh::field::content_disposition, "attachment;filename=" + name);
+            }
+
             if (req_.method() == bh::verb::head)
             {
-                bh::response<bh::empty_body> res{ bh::status::ok, req_.version() };
+                res.content_length(size);
+                return reply(res);
+            }
+
+            // A Range is ignored when If-Range names another version of the file
+            std::vector<std::pair<uint64_t, uint64_t>> ranges;
+            auto range = req_[bh::field::range];
+            auto ifRange = req_[bh::field::if_range];
+            int satisfiable = !range.empty() && (ifRange.empty() || ifRange == etag) ? parseRanges(range, size, ranges) : 0;
+            if (satisfiable < 0)
+            {
+                res.result(bh::status::range_not_satisfiable);
+                res.set(bh::field::content_range, fmt::format("bytes */{}", size));
+                res.content_length(0);
+                return reply(res);
+            }
+
+            std::vector<SendLambda::FileSlice> slices;
+            if (satisfiable == 0)
+            {
+                slices.push_back({ {}, 0, size });
+            }
+            else if (ranges.size() == 1)
+            {
+                res.result(bh::status::partial_content);
+                res.set(bh::field::content_range, fmt::format("bytes {}-{}/{}", ranges[0].first, ranges[0].second, size));
+                slices.push_back({ {}, ranges[0].first, ranges[0].second - ranges[0].first + 1 });
+            }
+            else
+            {
+                static thread_local std::mt19937_64 random{ std::random_device{}() };
+                const auto boundary = fmt::format("{:016x}{:016x}", random(), random());
+                res.result(bh::status::partial_content);
+                res.set(bh::field::content_type, "multipart/byteranges; boundary=" + boundary);
+                res.erase(bh::field::content_disposition);
+                for (const auto& r : ranges)
+                {
+                    auto prefix = fmt::format("{}--{}\r\nContent-Type: {}\r\nContent-Range: bytes {}-{}/{}\r\n\r\n",
+                        slices.empty() ? "" : "\r\n", boundary, mtype.empty() ? "application/octet-stream" : mtype.to_string(), r.first, r.second, size);
+                    slices.push_back({ std::move(prefix), r.first, r.second - r.first + 1 });
+                }
+                slices.push_back({ fmt::format("\r\n--{}--\r\n", boundary), 0, 0 });
+            }
+
+            uint64_t len = 0;
+            for (const auto& slice : slices)
+            {
+                len += slice.prefix.size() + slice.length;
+            }
+            res.content_length(len);
+            return replyFile(res, file, std::move(slices));
+        }
+
+        // Picks the smallest variant the client accepts, answers 304 when the client copy is current
+        void replyCachedFile(const std::string& path, const StaticFileCache::EntryPtr& entry, std::string name)
+        {
+            const std::string* body = &entry->identity;
+            const char* encoding = nullptr;
+            const char* suffix = "";
+            const auto accept = req_[bh::field::accept_encoding];
+            if (!entry->brotli.empty() && acceptsEncoding(accept, "br"))
+            {
+                body = &entry->brotli;
+                encoding = "br";
+                suffix = "-br";
+            }
+            else if (!entry->gzip.empty() && acceptsEncoding(accept, "gzip"))
+            {
+                body = &entry->gzip;
+                encoding = "gzip";
+                suffix = "-gz";
+            }
+
+            // Every variant has its own strong validator
+            std::string etag = entry->etag;
+            etag.insert(etag.size() - 1, suffix);
+            const auto decorate = [&](auto& res)
+            {
                 res.set(bh::field::server, HTTP_SERVER_VERSION);
-                res.set(bh::field::content_type, minetype(path));
-                res.content_length(body.size());
+                res.set(bh::field::etag, etag);
+                res.set(bh::field::cache_control, cache_->cacheControl());
+                res.set(bh::field::accept_ranges, "bytes");
+                if (!entry->gzip.empty() || !entry->brotli.empty())
+                {
+                    res.set(bh::field::vary, "Accept-Encoding");
+                }
                 res.keep_alive(req_.keep_alive());
+            };
+
+            if (matchEtag(req_[bh::field::if_none_match], entry->etag))
+            {
+                bh::response<bh::empty_body> res{ bh::status::not_modified, req_.version() };
+                decorate(res);
                 return reply(res);
             }
 
-            auto len = body.size();
-            bh::response<bh::file_body> res
-                {
-                    std::piecewise_construct,
-                    std::make_tuple(std::move(body)), std::make_tuple(bh::status::ok, req_.version())
-                };
-            res.set(bh::field::server, HTTP_SERVER_VERSION);
-            auto mtype = minetype(path);
-            if (mtype.empty())
+            const auto setType = [&](auto& res)
             {
+                auto mtype = minetype(path);
                 res.set(bh::field::content_type, mtype);
-                if (path.rfind('/') != std::string::npos)
+                if (encoding != nullptr)
+                {
+                    res.set(bh::field::content_encoding, encoding);
+                }
+                if (mtype.empty() && path.rfind('/') != std::string::npos)
                 {
                     if (name.empty())
                     {
@@ -626,19 +1562,33 @@ namespace http
                     }
                     res.set(bh::field::content_disposition, "attachment;filename=" + name);
                 }
-            }
-            else
+            };
+
+            if (req_.method() == bh::verb::head)
             {
-                res.set(bh::field::content_type, mtype);
+                bh::response<bh::empty_body> res{ bh::status::ok, req_.version() };
+                decorate(res);
+                setType(res);
+                res.content_length(body->size());
+                return reply(res);
             }
-            res.content_length(len);
-            res.keep_alive(req_.keep_alive());
+
+            // The body points into the cache entry, held by the session until the response is written
+            res_ = entry;
+            bh::response<bh::span_body<const char>> res
+                {
+                    std::piecewise_construct,
+                    std::make_tuple(body->data(), body->size()), std::make_tuple(bh::status::ok, req_.version())
+                };
+            decorate(res);
+            setType(res);
+            res.content_length(body->size());
             return reply(res);
         }
 
         void replyLocalFile()
         {
-            const auto& url = href();
+            const auto url = percentDecode(path());
             std::string path = catPath(root_, url);
             if (url.back() == '/')
             {
@@ -668,83 +1618,343 @@ namespace http
             return replyText("An error occurred: '" + what + "'.", bh::status::internal_server_error);
         };
 
+        void replyServiceUnavailable(int retryAfter = 1)
+        {
+            bh::response<bh::string_body> res{ bh::status::service_unavailable, req_.version() };
+            res.set(bh::field::content_type, "text/plain; charset=utf-8");
+            res.set(bh::field::retry_after, std::to_string(retryAfter));
+            res.keep_alive(req_.keep_alive());
+            res.body() = "Server busy, retry later.";
+            res.prepare_payload();
+            return reply(res);
+        }
+
     private:
-        void handleRequest(const HandlerRegistrarPtr& registrar)
+        // Validates the request and finds its hook, false when the request was answered already
+        bool route(const HandlerRegistrarPtr& registrar)
         {
             const auto& method = req_.method();
             const auto& url = req_.target();
 
             if (method == bh::verb::unknown)
             {
-                return replyBadRequest("Unknown HTTP-method");
+                replyBadRequest("Unknown HTTP-method");
+                return false;
             }
 
             if (url.empty() || url[0] != '/' || url.find("..") != string_view::npos)
             {
-                return replyBadRequest("Illegal request-target");
+                replyBadRequest("Illegal request-target");
+                return false;
+            }
+
+            parseArguments();
+            hook_ = registrar->find(*this);
+            return true;
+        }
+
+        [[nodiscard]] const RoutePolicy& policy() const
+        {
+            static const RoutePolicy none;
+            return hook_ == nullptr ? none : hook_->policy;
+        }
+
+        // Runs the hook of the request, a request without one is a static file
+        void dispatch()
+        {
+            if (hook_ == nullptr)
+            {
+                return replyLocalFile();
+            }
+            try
+            {
+                hook_->func(shared_from_this());
+            }
+            catch (const std::exception& e)
+            {
+                return replyText(e.what(), bh::status::internal_server_error);
+            }
+        }
+
+        // Reserves the response, the one of an offloaded hook past its deadline is dropped
+        bool claim()
+        {
+            std::unique_lock<std::mutex> lock(replyMutex_, std::defer_lock);
+            if (async_)
+            {
+                lock.lock();
+            }
+            if (replied_)
+            {
+                BOOST_ASSERT_MSG(expired_, "Duplicate reply");
+                if (expired_)
+                {
+                    LOG_WARN("Reply dropped, handler timed out, target={}", path());
+                }
+                return false;
+            }
+            replied_ = true;
+            return true;
+        }
+
+        // Resumes the connection once the response of an offloaded hook is staged, at once if it already is.
+        // Past the timeout the connection answers 504 itself, 0 waits forever
+        net::awaitable<void> waitReply(std::chrono::seconds timeout)
+        {
+            net::steady_timer timer(co_await net::this_coro::executor);
+            if (timeout.count() > 0)
+            {
+                timer.expires_after(timeout);
+                timer.async_wait([self = shared_from_this()](const beast::error_code& ec)
+                {
+                    if (!ec)
+                    {
+                        self->expire();
+                    }
+                });
+            }
+            co_await net::async_initiate<decltype(net::use_awaitable), void()>([this](auto handler)
+            {
+                std::function<void()> wake = [h = std::make_shared<decltype(handler)>(std::move(handler))]
+                {
+                    auto executor = net::get_associated_executor(*h);
+                    net::post(executor, std::move(*h));
+                };
+                std::unique_lock<std::mutex> lock(replyMutex_);
+                if (!staged_ && !expired_)
+                {
+                    onReply_ = std::move(wake);
+                    return;
+                }
+                lock.unlock();
+                wake();
+            }, net::use_awaitable);
+            timer.cancel();
+
+            std::lock_guard<std::mutex> lock(replyMutex_);
+            if (expired_)
+            {
+                bh::response<bh::string_body> res{ bh::status::gateway_timeout, req_.version() };
+                res.set(bh::field::content_type, "text/plain; charset=utf-8");
+                res.keep_alive(req_.keep_alive());
+                res.body() = "Handler timed out.";
+                res.prepare_payload();
+                repStatusCode_ = (int)res.result();
+                repContentLen_ = res.body().size();
+                send_(std::move(res));
+            }
+        }
+
+        // Gives up on the reply of an offloaded hook and wakes its connection, unless a reply is already on its way
+        void expire()
+        {
+            std::function<void()> wake;
+            {
+                std::lock_guard<std::mutex> lock(replyMutex_);
+                if (replied_)
+                {
+                    return;
+                }
+                replied_ = true;
+                expired_ = true;
+                wake.swap(onReply_);
+            }
+            if (wake)
+            {
+                wake();
+            }
+        }
+
+        // Called once the response is staged, wakes the connection of an offloaded hook
+        void staged()
+        {
+            if (!async_)
+            {
+                return;
+            }
+            std::function<void()> wake;
+            {
+                std::lock_guard<std::mutex> lock(replyMutex_);
+                staged_ = true;
+                wake.swap(onReply_);
+            }
+            if (wake)
+            {
+                wake();
+            }
+        }
+
+        // Splits the raw query in place, keys and values are views into the request target
+        void parseArguments()
+        {
+            args_.clear();
+            std::string_view query(req_.target().data(), req_.target().size());
+            auto pos = query.find('?');
+            if (pos == std::string_view::npos)
+            {
+                return;
+            }
+            query = query.substr(pos + 1);
+            query = query.substr(0, query.find('#'));
+            while (!query.empty())
+            {
+                auto end = query.find('&');
+                auto pair = query.substr(0, end);
+                query = end == std::string_view::npos ? std::string_view() : query.substr(end + 1);
+                if (pair.empty())
+                {
+                    continue;
+                }
+                auto eq = pair.find('=');
+                Argument a;
+                a.key = pair.substr(0, eq);
+                a.value = eq == std::string_view::npos ? std::string_view() : pair.substr(eq + 1);
+                a.encoded = a.value.find_first_of("%+") != std::string_view::npos;
+                a.encodedKey = a.key.find_first_of("%+") != std::string_view::npos;
+                args_.push_back(a);
+            }
+        }
+
+        // Route params are views into the raw request path and into the names of the matched route
+        void addArgument(std::string_view key, std::string_view val)
+        {
+            args_.push_back(Argument{ key, val, val.find_first_of("%+") != std::string_view::npos, false });
+        }
+
+        // Inclusive byte ranges of a Range header, 1 when usable, 0 to ignore it, -1 when none is satisfiable
+        static int parseRanges(string_view header, uint64_t size, std::vector<std::pair<uint64_t, uint64_t>>& ranges)
+        {
+            static constexpr size_t MAX_RANGES = 16;
+            std::string_view rest(header.data(), header.size());
+            if (rest.substr(0, 6) != "bytes=")
+            {
+                return 0;
+            }
+            rest = rest.substr(6);
+            const auto number = [](std::string_view s, uint64_t& n)
+            {
+                s = boost::trim_copy(s);
+                if (s.empty() || s.find_first_not_of("0123456789") != std::string_view::npos || s.size() > 19)
+                {
+                    return false;
+                }
+                n = std::stoull(std::string(s));
+                return true;
+            };
+            while (!rest.empty())
+            {
+                auto end = rest.find(',');
+                auto spec = rest.substr(0, end);
+                rest = end == std::string_view::npos ? std::string_view() : rest.substr(end + 1);
+                auto dash = spec.find('-');
+                if (dash == std::string_view::npos)
+                {
+                    return 0;
+                }
+                uint64_t first = 0;
+                uint64_t last = 0;
+                auto from = boost::trim_copy(spec.substr(0, dash));
+                auto to = boost::trim_copy(spec.substr(dash + 1));
+                if (from.empty())
+                {
+                    // Suffix range, the last bytes of the file
+                    if (!number(to, last))
+                    {
+                        return 0;
+                    }
+                    if (last == 0 || size == 0)
+                    {
+                        continue;
+                    }
+                    first = size - std::min(last, size);
+                    last = size - 1;
+                }
+                else
+                {
+                    if (!number(from, first) || (!to.empty() && !number(to, last)) || (!to.empty() && last < first))
+                    {
+                        return 0;
+                    }
+                    if (first >= size)
+                    {
+                        continue;
+                    }
+                    last = to.empty() ? size - 1 : std::min(last, size - 1);
+                }
+                if (ranges.size() == MAX_RANGES)
+                {
+                    return 0;
+                }
+                ranges.emplace_back(first, last);
             }
+            return ranges.empty() ? -1 : 1;
+        }
 
-            parseArguments();
-            try
+        // Whether the client listed the coding without q=0
+        static bool acceptsEncoding(string_view header, string_view coding)
+        {
+            std::string_view rest(header.data(), header.size());
+            while (!rest.empty())
             {
-                bool ok = registrar->process(shared_from_this());
-                if (ok)
+                auto end = rest.find(',');
+                auto token = rest.substr(0, end);
+                rest = end == std::string_view::npos ? std::string_view() : rest.substr(end + 1);
+                auto semi = token.find(';');
+                auto name = boost::trim_copy(token.substr(0, semi));
+                if (!boost::iequals(name, std::string_view(coding.data(), coding.size())))
                 {
-                    return;
+                    continue;
                 }
+                if (semi == std::string_view::npos)
+                {
+                    return true;
+                }
+                auto params = boost::erase_all_copy(std::string(token.substr(semi + 1)), " ");
+                return params != "q=0" && params != "q=0.0" && params != "q=0.00" && params != "q=0.000";
             }
-            catch (const std::exception& e)
-            {
-                return replyText(e.what(), bh::status::internal_server_error);
-            }
-
-            return replyLocalFile();
+            return false;
         }
 
-        void parseArguments()
+        // Weak comparison of If-None-Match against any variant of the entry
+        static bool matchEtag(string_view header, const std::string& etag)
         {
-            args_.clear();
-            std::string url = href();
-            if (url.find('?') == std::string::npos)
+            std::string_view rest(header.data(), header.size());
+            const std::string_view base(etag.data(), etag.size() - 1);
+            while (!rest.empty())
             {
-                return;
-            }
-            url = url.substr(url.find_first_of('?') + 1);
-            std::string key;
-            std::string value;
-            bool inKeyTurn = true;
-            for (char c : url)
-            {
-                switch (c)
+                auto end = rest.find(',');
+                auto token = boost::trim_copy(rest.substr(0, end));
+                rest = end == std::string_view::npos ? std::string_view() : rest.substr(end + 1);
+                if (token == "*")
+                {
+                    return true;
+                }
+                if (token.substr(0, 2) == "W/")
+                {
+                    token = token.substr(2);
+                }
+                if (token.substr(0, base.size()) == base)
                 {
-                case '&':
-                    if (!key.empty() || !value.empty())
+                    auto suffix = token.substr(base.size());
+                    if (suffix == "\"" || suffix == "-gz\"" || suffix == "-br\"")
                     {
-                        args_[boost::to_lower_copy(key)] = value;
+                        return true;
                     }
-                    key.clear();
-                    value.clear();
-                    inKeyTurn = true;
-                    break;
-                case '=':
-                    inKeyTurn = false;
-                    break;
-                case '#':
-                    break;
-                default:
-                    inKeyTurn ? key += c : value += c;
-                    break;
                 }
             }
-            if (!key.empty() || !value.empty())
-            {
-                args_[boost::to_lower_copy(key)] = value;
-            }
+            return false;
         }
 
-        void addArgument(const std::string& key, const std::string& val)
+        const Argument* findArgument(std::string_view key) const
         {
-            args_[key] = val;
+            for (auto it = args_.rbegin(); it != args_.rend(); ++it)
+            {
+                if (it->hasKey(key))
+                {
+                    return &*it;
+                }
+            }
+            return nullptr;
         }
 
     private:
@@ -752,13 +1962,27 @@ namespace http
         bh::request<bh::string_body> req_;
         SendLambda send_;
 
-        std::shared_ptr<void> res_;
-        std::string href_;
-        std::map<std::string, std::string> args_;
+        std::shared_ptr<const void> res_;
+        StaticFileCache* cache_{ nullptr };
+        Arguments args_;
+        // The route table the hook was found in, keeps the hook and the names of its params alive once the table moved on
+        HandlerRegistrar::Pin route_;
+        const HandlerRegistrar::HookFunctor* hook_{ nullptr };
+        std::string bodyFile_;
 
+        uint64_t reqContentLen_{ 0 };
         int repStatusCode_{ (int)bh::status::ok };
-        int repContentLen_{ 0 };
+        uint64_t repContentLen_{ 0 };
         bool replied_{ false };
+
+        // Set before an offloaded hook runs, its reply may then come from any thread
+        bool async_{ false };
+        std::mutex replyMutex_;
+        bool staged_{ false };
+        bool expired_{ false };
+        std::function<void()> onReply_;
+        // Links the session into the waiters of its offload shard while its connection waits for the reply
+        boost::intrusive::list_member_hook<> waiter_;
     };
 
 
@@ -777,6 +2001,7 @@ namespace http
             , registrar_(std::make_shared<HandlerRegistrar>())
         {
             enableListApi();
+            enableMetricsApi();
         }
 
         ~Server()
@@ -791,36 +2016,128 @@ namespace http
             timeout_ = seconds;
         }
 
+        // Call this method before listen, every thread then owns an io_context and an acceptor of its own,
+        // the kernel spreads the connections over the acceptors (SO_REUSEPORT) and a connection never leaves its thread
+        void setSharded(bool sharded)
+        {
+            shards_.clear();
+            for (auto i = 0; sharded && i < threadCount_; ++i)
+            {
+                shards_.push_back(std::make_unique<net::io_context>(1));
+            }
+        }
+
+        // Call this method before listen, requests over the limits are answered 503 with Retry-After
+        void setAdmission(const AdmissionControl::Limits& limits)
+        {
+            admission_.setLimits(limits);
+        }
+
+        [[nodiscard]] AdmissionControl::Stats admissionStats() const
+        {
+            return admission_.stats();
+        }
+
+        // Call this method before listen, the body limit of the routes without one of their own
+        void setBodyLimit(uint64_t bytes)
+        {
+            bodyLimit_ = bytes;
+        }
+
+        // Call this method before listen, empty spools the bodies of BODY_SPOOLED routes to the temporary directory
+        void setSpoolDirectory(std::string dir)
+        {
+            spoolDir_ = std::move(dir);
+        }
+
+        // Call this method before listen, the threads running the hooks of HANDLER_OFFLOADED routes,
+        // started on the first offloaded request
+        void setWorkerThreads(size_t count)
+        {
+            workerThreads_ = std::max<size_t>(count, 1);
+        }
+
+        // Call this method before listen, an offloaded hook not replying in time is answered 504, 0 waits forever
+        void setHandlerTimeout(int seconds)
+        {
+            handlerTimeout_ = seconds;
+        }
+
+        // Call this method before listen, the send queue and compression policy of every WebSocket client
+        void setWebSocketPolicy(const WebSocketPolicy& policy)
+        {
+            wshandler_.setPolicy([policy](const bh::request<bh::string_body>&)
+            {
+                return policy;
+            });
+        }
+
+        // Call this method before listen, picks the policy of a WebSocket client from its upgrade request
+        void setWebSocketPolicy(WebSocketGroupHandler::PolicySelector select)
+        {
+            wshandler_.setPolicy(std::move(select));
+        }
+
+        // Sends a message to every WebSocket client of the group from any thread, the payload is shared, not copied per client
+        size_t publish(const std::string& group, std::string payload, bool text = true)
+        {
+            auto frame = std::make_shared<const WebSocketGroupHandler::Frame>(WebSocketGroupHandler::Frame{ std::move(payload), text });
+            return wshandler_.publish(group, frame);
+        }
+
+        [[nodiscard]] WebSocketGroupHandler::Stats webSocketStats() const
+        {
+            return wshandler_.stats();
+        }
+
+        // Call this method before run, null serves every static file from disk
+        void setFileCache(StaticFileCachePtr cache)
+        {
+            fileCache_ = std::move(cache);
+        }
+
         // Register a hook function to handle custom requests
+        // The policy sets the priority of the route, how many of its requests are handled at once and how its bodies are read
         template<boost::beast::http::verb verb>
-        bool hook(const std::string& target, const HookFunc& func)
+        bool hook(const std::string& target, const HookFunc& func, const RoutePolicy& policy = {})
         {
-            return hook(verb, target, func);
+            return hook(verb, target, func, policy);
         }
 
         template<char* method>
-        bool hook(const std::string& target, const HookFunc& func)
+        bool hook(const std::string& target, const HookFunc& func, const RoutePolicy& policy = {})
         {
-            return hook(std::string(method), target, func);
+            return hook(std::string(method), target, func, policy);
         }
 
-        bool hook(bh::verb verb, const std::string& target, const HookFunc& func)
+        bool hook(bh::verb verb, const std::string& target, const HookFunc& func, const RoutePolicy& policy = {})
         {
             assert(verb != bh::verb::unknown);
             assert(!target.empty());
             assert(func != nullptr);
-            return registrar_->add(verb, target, func);
+            return registrar_->add(verb, target, func, policy, &metrics_);
         }
 
-        bool hook(const std::string& method, const std::string& target, const HookFunc& func)
+        bool hook(const std::string& method, const std::string& target, const HookFunc& func, const RoutePolicy& policy = {})
         {
             auto verb = bh::string_to_verb(boost::to_upper_copy(method));
-            return hook(verb, target, func);
+            return hook(verb, target, func, policy);
         }
 
         bool hook(const Route& r)
         {
-            return hook(r.method, r.url, r.handler);
+            return hook(r.method, r.url, r.handler, r.policy);
+        }
+
+        // Routes may be hooked and unhooked while serving, requests in flight keep the previous routes
+        bool unhook(bh::verb verb, const std::string& target)
+        {
+            return registrar_->remove(verb, target);
+        }
+
+        bool unhook(const std::string& method, const std::string& target)
+        {
+            return unhook(bh::string_to_verb(boost::to_upper_copy(method)), target);
         }
 
         void listen(int port = 0)
@@ -829,17 +2146,40 @@ namespace http
             {
                 port_ = port;
             }
-            net::spawn(io_, std::bind(&Server::doListen, this, std::placeholders::_1));
 
             std::vector<std::thread> threads;
             threads.reserve(threadCount_);
-            for (auto i = 0; i < threadCount_; ++i)
+            if (shards_.empty())
             {
-                threads.emplace_back([=]
+                net::co_spawn(io_, doListen(io_), net::detached);
+                for (auto i = 0; i < threadCount_; ++i)
                 {
-                    boost::system::error_code ec;
-                    io_.run(ec);
-                });
+                    threads.emplace_back([this]
+                    {
+                        boost::system::error_code ec;
+                        io_.run(ec);
+                    });
+                }
+            }
+            else
+            {
+#ifdef SO_REUSEPORT
+                for (auto& shard : shards_)
+                {
+                    net::co_spawn(*shard, doListen(*shard), net::detached);
+                }
+#else
+                // Without SO_REUSEPORT the first shard accepts and hands the connections out in turn
+                net::co_spawn(*shards_.front(), doListen(*shards_.front()), net::detached);
+#endif
+                for (auto& shard : shards_)
+                {
+                    threads.emplace_back([io = shard.get()]
+                    {
+                        boost::system::error_code ec;
+                        io->run(ec);
+                    });
+                }
             }
             for (auto& t : threads)
             {
@@ -849,11 +2189,29 @@ namespace http
 
         void stop()
         {
+            // Connections waiting for offloaded hooks let go of them, the hooks still queued are dropped with the workers.
+            // A woken connection unlinks its session itself
+            for (auto& shard : offloads_)
+            {
+                std::lock_guard<std::mutex> lock(shard.mutex);
+                for (auto& s : shard.waiters)
+                {
+                    s.expire();
+                }
+            }
             registrar_.reset();
             if (!io_.stopped())
             {
                 io_.stop();
             }
+            for (auto& shard : shards_)
+            {
+                shard->stop();
+            }
+            if (workers_ != nullptr)
+            {
+                workers_->stop();
+            }
         }
 
     private:
@@ -864,14 +2222,11 @@ namespace http
             hook("GET", API_LIST, [&](const SessionPtr& session)
             {
                 std::stringstream ss;
-                for (const auto& it : registrar_->hooks_)
+                for (const auto& [verb, url] : registrar_->routes())
                 {
-                    for (const auto& h : it.second)
+                    if (url != API_LIST)
                     {
-                        if (h.url != API_LIST)
-                        {
-                            ss << std::setw(6) << it.first << " " << h.url << "\n";
-                        }
+                        ss << std::setw(6) << verb << " " << url << "\n";
                     }
                 }
                 std::string txt{ ss.str() };
@@ -884,70 +2239,154 @@ namespace http
             });
         }
 
-        void doListen(const net::yield_context& yield)
+        // Prometheus text exposition of every route, requests matching none are under the route "(none)"
+        void enableMetricsApi()
+        {
+            hook("GET", "/$metrics", [&](const SessionPtr& session)
+            {
+                std::string txt;
+                metrics_.write(txt);
+                const auto stats = admission_.stats();
+                MetricsRegistry::header(txt, "asula_http_connections", "gauge", "Open connections, counted when admission control is enabled");
+                txt += fmt::format("asula_http_connections {}\n", stats.connections);
+                MetricsRegistry::header(txt, "asula_http_requests_in_flight", "gauge", "Admitted requests not yet answered");
+                txt += fmt::format("asula_http_requests_in_flight {}\n", stats.inFlight);
+                MetricsRegistry::header(txt, "asula_http_requests_queued", "gauge", "Requests waiting for admission");
+                txt += fmt::format("asula_http_requests_queued {}\n", stats.queued);
+                MetricsRegistry::header(txt, "asula_http_admission_rejected_total", "counter", "Connections and requests answered 503");
+                txt += fmt::format("asula_http_admission_rejected_total{{reason=\"connections\"}} {}\n", stats.rejectedConnections);
+                txt += fmt::format("asula_http_admission_rejected_total{{reason=\"queue_full\"}} {}\n", stats.rejectedRequests);
+                txt += fmt::format("asula_http_admission_rejected_total{{reason=\"evicted\"}} {}\n", stats.evicted);
+                txt += fmt::format("asula_http_admission_rejected_total{{reason=\"timeout\"}} {}\n", stats.timedOut);
+                MetricsRegistry::header(txt, "asula_http_admission_queue_seconds", "summary", "Time waited for admission");
+                txt += fmt::format("asula_http_admission_queue_seconds_sum {}\n", MetricsRegistry::seconds(stats.queueTimeUs));
+                txt += fmt::format("asula_http_admission_queue_seconds_count {}\n", stats.waited);
+                const auto ws = wshandler_.stats();
+                MetricsRegistry::header(txt, "asula_websocket_clients", "gauge", "WebSocket clients in a group");
+                txt += fmt::format("asula_websocket_clients {}\n", ws.clients);
+                MetricsRegistry::header(txt, "asula_websocket_slow_consumer_total", "counter", "Messages dropped or coalesced and clients disconnected for a full send queue");
+                txt += fmt::format("asula_websocket_slow_consumer_total{{action=\"dropped\"}} {}\n", ws.dropped);
+                txt += fmt::format("asula_websocket_slow_consumer_total{{action=\"coalesced\"}} {}\n", ws.coalesced);
+                txt += fmt::format("asula_websocket_slow_consumer_total{{action=\"disconnected\"}} {}\n", ws.disconnected);
+                session->replyText(txt);
+                return true;
+            });
+        }
+
+        net::awaitable<void> doListen(net::io_context& io)
         {
             beast::error_code ec;
 
             tcp::endpoint endpoint{ tcp::v4(), port_ };
-            tcp::acceptor acceptor(io_);
+            tcp::acceptor acceptor(io);
             acceptor.open(endpoint.protocol(), ec);
             if (ec)
             {
                 LOG_ERROR("Open host failed, {}", ec.message());
-                return;
+                co_return;
             }
 
             acceptor.set_option(net::socket_base::reuse_address(true), ec);
             if (ec)
             {
                 LOG_ERROR("Set option failed, {}", ec.message());
-                return;
+                co_return;
+            }
+
+#ifdef SO_REUSEPORT
+            if (!shards_.empty())
+            {
+                acceptor.set_option(net::detail::socket_option::boolean<SOL_SOCKET, SO_REUSEPORT>(true), ec);
+                if (ec)
+                {
+                    LOG_ERROR("Set reuse port failed, {}", ec.message());
+                    co_return;
+                }
             }
+#endif
 
             acceptor.bind(endpoint, ec);
             if (ec)
             {
                 LOG_ERROR("Bind failed, {}", ec.message());
-                return;
+                co_return;
             }
 
             acceptor.listen(net::socket_base::max_listen_connections, ec);
             if (ec)
             {
                 LOG_ERROR("Listen failed, {}", ec.message());
-                return;
+                co_return;
             }
 
+#ifndef SO_REUSEPORT
+            size_t next = 0;
+#endif
             for (;;)
             {
-                tcp::socket socket(io_);
-                acceptor.async_accept(socket, yield[ec]);
+#ifdef SO_REUSEPORT
+                tcp::socket socket(io);
+#else
+                tcp::socket socket(shards_.empty() ? io : *shards_[next++ % shards_.size()]);
+#endif
+                co_await acceptor.async_accept(socket, net::redirect_error(net::use_awaitable, ec));
                 if (ec)
                 {
                     LOG_ERROR("Accept failed, {}", ec.message());
                     continue;
                 }
-                net::spawn(acceptor.get_executor(), std::bind(&Server::doConnection, this, std::move(socket), std::placeholders::_1));
+                // The timers of a connection complete on its strand, never beside the coroutine on another thread
+                auto strand = net::make_strand(socket.get_executor());
+                net::co_spawn(strand, doConnection(std::move(socket)), net::detached);
             }
         }
 
-        // Handles an HTTP server connection
-        void doConnection(tcp::socket& socket, const net::yield_context& yield)
+        // Handles an HTTP server connection, a stackless frame of a few hundred bytes while the connection idles
+        net::awaitable<void> doConnection(tcp::socket socket)
         {
             beast::error_code ec;
             beast::flat_buffer buffer;
-            bool close = false;
-
+            auto connected = admission_.enabled() ? admission_.connect() : AdmissionControl::Ticket();
             beast::tcp_stream stream(std::move(socket));
+            if (admission_.enabled() && !connected)
+            {
+                co_await rejectConnection(stream);
+                co_return;
+            }
+
+            // A connection waiting longer than this for its next request gives its buffer and parser back
+            static constexpr auto IDLE_RELEASE = std::chrono::seconds(1);
+            // Reused by every request of the connection, emplaced again for each one
+            std::optional<bh::request_parser<bh::empty_body>> parser;
+            const auto timeout = std::chrono::seconds(timeout_);
             for (;;)
             {
+                // Back to back requests keep the buffer and the parser, a connection idle for a while waits without them
+                if (buffer.size() == 0)
+                {
+                    const bool release = timeout_ <= 0 || timeout > IDLE_RELEASE;
+                    co_await waitIdle(stream, release ? IDLE_RELEASE : timeout, ec);
+                    if (release && ec == beast::error::timeout)
+                    {
+                        buffer.shrink_to_fit();
+                        parser.reset();
+                        co_await waitIdle(stream, timeout_ <= 0 ? std::chrono::seconds(0) : timeout - IDLE_RELEASE, ec);
+                    }
+                    if (ec)
+                    {
+                        break;
+                    }
+                }
                 if (timeout_ > 0)
                 {
                     stream.expires_after(std::chrono::seconds(timeout_));
                 }
 
-                bh::request<bh::string_body> req;
-                bh::async_read(stream, buffer, req, yield[ec]);
+                // The header comes first, the route of the request decides how its body is read
+                parser.emplace();
+                // Body limits are per route, checked once the route is known. Not none, beast compares a content length against it
+                parser->body_limit(std::numeric_limits<uint64_t>::max());
+                co_await bh::async_read_header(stream, buffer, *parser, net::redirect_error(net::use_awaitable, ec));
 //                if (ec == bh::error::end_of_stream)
 //                {
 //                    break;
@@ -959,18 +2398,33 @@ namespace http
                     break;
                 }
 
-                if (websocket::is_upgrade(req))
+                if (websocket::is_upgrade(parser->get()))
                 {
-                    wshandler_.handle(req, stream, ec, yield);
+                    bh::request<bh::string_body> req(std::move(parser->release().base()));
+                    co_await wshandler_.handle(req, stream, ec);
                     break;
                 }
+
+                // A request with a body keeps its parser to read it, the session takes a copy of the header
+                SessionPtr s;
+                if (parser->is_done())
+                {
+                    s = std::make_shared<Session>(docRoot_, bh::request<bh::string_body>(std::move(parser->release().base())));
+                    parser.reset();
+                }
                 else
                 {
-                    SendLambda lambda{ stream, close, ec, yield };
-                    doProcessRequest(req, lambda);
+                    s = std::make_shared<Session>(docRoot_, bh::request<bh::string_body>(parser->get().base()));
                 }
-
-                if (close)
+                const auto start = std::chrono::steady_clock::now();
+                AdmissionControl::Ticket ticket;
+                co_await doProcessRequest(s, ticket, stream, buffer, parser);
+                // Taken before writing, the metrics of a hook outlive it
+                auto* metrics = s->hook_ == nullptr || s->hook_->metrics == nullptr ? unrouted_ : s->hook_->metrics;
+                co_await s->send_.flush(stream, std::chrono::seconds(timeout_), ec);
+                auto us = std::chrono::duration_cast<std::chrono::microseconds>(std::chrono::steady_clock::now() - start).count();
+                metrics->record((uint64_t)us, s->reqContentLen_, s->repContentLen_, s->repStatusCode_);
+                if (s->send_.close_)
                 {
                     break;
                 }
@@ -978,71 +2432,362 @@ namespace http
             stream.socket().shutdown(tcp::socket::shutdown_send, ec);
         }
 
-        void doProcessRequest(bh::request<bh::string_body>& req, SendLambda& lambda)
+        // A connection over the limit is answered 503 at once and closed, without waiting for its request
+        net::awaitable<void> rejectConnection(beast::tcp_stream& stream)
+        {
+            static constexpr auto REJECT_TIMEOUT = std::chrono::seconds(5);
+
+            bh::response<bh::string_body> res{ bh::status::service_unavailable, 11 };
+            res.set(bh::field::server, HTTP_SERVER_VERSION);
+            res.set(bh::field::content_type, "text/plain; charset=utf-8");
+            res.set(bh::field::retry_after, std::to_string(admission_.limits().retryAfter));
+            res.keep_alive(false);
+            res.body() = "Server busy, retry later.";
+            res.prepare_payload();
+
+            beast::error_code ec;
+            // A client not reading the answer holds the socket no longer than this
+            stream.expires_after(REJECT_TIMEOUT);
+            co_await bh::async_write(stream, res, net::redirect_error(net::use_awaitable, ec));
+            stream.socket().shutdown(tcp::socket::shutdown_send, ec);
+            stream.close();
+        }
+
+        // Waits for the next request, failing with beast::error::timeout once it idled for the timeout, 0 waits forever.
+        // The wait bypasses the expiry of the stream, a timer on the strand of the connection stands in for it
+        net::awaitable<void> waitIdle(beast::tcp_stream& stream, std::chrono::seconds timeout, beast::error_code& ec)
+        {
+            net::steady_timer timer(co_await net::this_coro::executor);
+            // A timer that fired as the bytes came must not cancel the read of the request
+            auto idle = std::make_shared<bool>(true);
+            if (timeout.count() > 0)
+            {
+                timer.expires_after(timeout);
+                timer.async_wait([idle, &stream](const beast::error_code& e)
+                {
+                    if (!e && *idle)
+                    {
+                        stream.socket().cancel();
+                    }
+                });
+            }
+            co_await stream.socket().async_wait(tcp::socket::wait_read, net::redirect_error(net::use_awaitable, ec));
+            *idle = false;
+            if (ec == net::error::operation_aborted)
+            {
+                ec = beast::error::timeout;
+            }
+        }
+
+        // Runs the handler once admitted and its body read, the response it replied with is left in the session
+        // for the connection to write. The ticket holds the slot of the request until the response is written
+        net::awaitable<void> doProcessRequest(const SessionPtr& s, AdmissionControl::Ticket& ticket,
+                                              beast::tcp_stream& stream, beast::flat_buffer& buffer, std::optional<bh::request_parser<bh::empty_body>>& body)
         {
-            auto s = std::make_shared<Session>(docRoot_, std::move(req), std::move(lambda));
-            LOG_DEBUG("HTTP REQ: {} {}", s->method(), s->href());
-            s->handleRequest(registrar_);
+            s->cache_ = fileCache_.get();
+            LOG_DEBUG("HTTP REQ: {} {}", s->method(), s->path());
+            bool complete = !body.has_value();
+            if (s->route(registrar_))
+            {
+                const auto& policy = s->policy();
+                const bool limited = admission_.enabled(policy.maxInFlight);
+                if (limited)
+                {
+                    ticket = co_await admission_.admit(policy.priority, policy.maxInFlight, s->hook_ == nullptr ? nullptr : &s->hook_->inFlight);
+                }
+                if (limited && !ticket)
+                {
+                    s->replyServiceUnavailable(admission_.limits().retryAfter);
+                }
+                else
+                {
+                    if (!complete)
+                    {
+                        complete = co_await readBody(s, stream, buffer, std::move(*body));
+                    }
+                    if (complete && policy.handler == HANDLER_OFFLOADED)
+                    {
+                        co_await offload(s);
+                    }
+                    else if (complete)
+                    {
+                        s->dispatch();
+                    }
+                }
+            }
             if (!s->replied_)
             {
                 BOOST_ASSERT_MSG(!s->replied_, "No reply");
                 s->replyServerError("No reply");
             }
-            LOG_DEBUG("HTTP REP: {} {} {}", s->method(), s->href(), s->responseCode());
+            // The rest of an unread body would be taken for the next request
+            if (!complete)
+            {
+                s->send_.close_ = true;
+            }
+            LOG_DEBUG("HTTP REP: {} {} {}", s->method(), s->path(), s->responseCode());
+        }
+
+        // Runs the hook on the workers, the connection waits for its reply without holding the io thread
+        net::awaitable<void> offload(const SessionPtr& s)
+        {
+            std::call_once(workersOnce_, [this]
+            {
+                workers_ = std::make_unique<net::thread_pool>(workerThreads_);
+            });
+            s->async_ = true;
+            auto& shard = offloads_[std::hash<const Session*>{}(s.get()) % OFFLOAD_SHARDS];
+            {
+                std::lock_guard<std::mutex> lock(shard.mutex);
+                shard.waiters.push_back(*s);
+            }
+            net::post(*workers_, [s]
+            {
+                s->dispatch();
+            });
+            co_await s->waitReply(std::chrono::seconds(handlerTimeout_));
+            std::lock_guard<std::mutex> lock(shard.mutex);
+            shard.waiters.erase(shard.waiters.iterator_to(*s));
+        }
+
+        // Reads the body the way the route of the request asks for, false once the request was answered
+        net::awaitable<bool> readBody(const SessionPtr& s, beast::tcp_stream& stream, beast::flat_buffer& buffer, bh::request_parser<bh::empty_body>&& header)
+        {
+            const auto& policy = s->policy();
+            const auto limit = policy.maxBodySize > 0 ? policy.maxBodySize : bodyLimit_;
+            const auto length = header.content_length();
+            if (length && *length > limit)
+            {
+                s->replyText("Request body too large.", bh::status::payload_too_large);
+                co_return false;
+            }
+
+            beast::error_code ec;
+            // The client waits for a go before uploading, it only comes once the request is admitted
+            if (boost::iequals(header.get()[bh::field::expect], "100-continue"))
+            {
+                bh::response<bh::empty_body> res{ bh::status::continue_, header.get().version() };
+                co_await bh::async_write(stream, res, net::redirect_error(net::use_awaitable, ec));
+            }
+
+            bool accepted = true;
+            if (!ec && policy.body == BODY_STREAMED)
+            {
+                bh::request_parser<bh::buffer_body> parser{ std::move(header) };
+                parser.body_limit(limit);
+                std::vector<char> chunk(64 * 1024);
+                while (!parser.is_done() && !ec && accepted)
+                {
+                    parser.get().body().data = chunk.data();
+                    parser.get().body().size = chunk.size();
+                    co_await bh::async_read(stream, buffer, parser, net::redirect_error(net::use_awaitable, ec));
+                    if (ec == bh::error::need_buffer)
+                    {
+                        ec = {};
+                    }
+                    const auto n = chunk.size() - parser.get().body().size;
+                    s->reqContentLen_ += n;
+                    if (!ec && n > 0 && policy.onBody != nullptr)
+                    {
+                        accepted = policy.onBody(s, std::string_view(chunk.data(), n));
+                    }
+                }
+            }
+            else if (!ec && policy.body == BODY_SPOOLED)
+            {
+                bh::request_parser<bh::file_body> parser{ std::move(header) };
+                parser.body_limit(limit);
+                std::error_code fec;
+                auto dir = spoolDir_.empty() ? std::filesystem::temp_directory_path(fec) : std::filesystem::path(spoolDir_);
+                static thread_local std::mt19937_64 random{ std::random_device{}() };
+                auto path = (dir / fmt::format("asula-{:016x}.body", random())).string();
+                parser.get().body().open(path.c_str(), beast::file_mode::write, ec);
+                if (ec)
+                {
+                    LOG_ERROR("Open spool file failed, path={}, err={}", path, ec.message());
+                    s->replyServerError(ec.message());
+                    co_return false;
+                }
+                s->bodyFile_ = path;
+                co_await bh::async_read(stream, buffer, parser, net::redirect_error(net::use_awaitable, ec));
+                beast::error_code sec;
+                s->reqContentLen_ = parser.get().body().file().size(sec);
+            }
+            else if (!ec)
+            {
+                bh::request_parser<bh::string_body> parser{ std::move(header) };
+                parser.body_limit(limit);
+                co_await bh::async_read(stream, buffer, parser, net::redirect_error(net::use_awaitable, ec));
+                s->req_.body() = std::move(parser.get().body());
+                s->reqContentLen_ = s->req_.body().size();
+            }
+
+            if (ec == bh::error::body_limit)
+            {
+                s->replyText("Request body too large.", bh::status::payload_too_large);
+            }
+            else if (ec)
+            {
+                s->replyBadRequest("Read request body failed, " + ec.message());
+            }
+            else if (!accepted && !s->replied_)
+            {
+                s->replyBadRequest("Request body rejected");
+            }
+            co_return !ec && accepted;
         }
 
 
     private:
+        static constexpr size_t OFFLOAD_SHARDS = 16;
+
+        // Sessions waiting for the reply of an offloaded hook, linked through the sessions so waiting allocates nothing.
+        // Only stop walks them
+        struct alignas(64) OffloadShard
+        {
+            std::mutex mutex;
+            boost::intrusive::list<Session,
+                boost::intrusive::member_hook<Session, boost::intrusive::list_member_hook<>, &Session::waiter_>,
+                boost::intrusive::constant_time_size<false>> waiters;
+        };
+
         net::io_context io_;
+        // One io_context per thread in sharded mode, io_ is then left idle
+        std::vector<std::unique_ptr<net::io_context>> shards_;
         uint16_t port_{ 0 };
         int threadCount_{ 1 };
         int timeout_{ 0 };
         std::string docRoot_;
+        StaticFileCachePtr fileCache_{ std::make_shared<StaticFileCache>() };
+        AdmissionControl admission_;
+        MetricsRegistry metrics_;
+        RouteMetrics* unrouted_{ metrics_.route("", "(none)") };
+        uint64_t bodyLimit_{ 1024 * 1024 };
+        std::string spoolDir_;
         HandlerRegistrarPtr registrar_;
         WebSocketGroupHandler wshandler_;
+        size_t workerThreads_{ 4 };
+        int handlerTimeout_{ 30 };
+        std::once_flag workersOnce_;
+        // Spread by session so concurrent offloads rarely share a mutex, unlinked before the coroutines holding the sessions go
+        std::array<OffloadShard, OFFLOAD_SHARDS> offloads_;
+        // Destroyed first, joining the hooks still running
+        std::unique_ptr<net::thread_pool> workers_;
     };
 
-    inline bool HandlerRegistrar::add(bh::verb verb, const std::string& target, const HookFunc& func)
+    inline bool HandlerRegistrar::add(bh::verb verb, const std::string& target, const HookFunc& func, const RoutePolicy& policy, MetricsRegistry* metrics)
     {
         if (verb == bh::verb::unknown || target.empty() || func == nullptr)
         {
             LOG_ERROR("Invalid argument, method={}, target={}", bh::to_string(verb).to_string(), target);
             return false;
         }
-        std::string url = boost::to_lower_copy(target);
-        auto[_, ok] = hooks_[verb].emplace(HookFunctor{ url, func });
-        if (!ok)
+        auto hook = std::make_shared<HookFunctor>();
+        hook->url = boost::to_lower_copy(target);
+        hook->func = func;
+        hook->policy = policy;
+        std::string_view path(hook->url);
+        path = path.substr(0, path.find('?'));
+        for (auto p = path, segment = nextSegment(p); !segment.empty(); segment = nextSegment(p))
+        {
+            if (isFuzzy(segment))
+            {
+                hook->params.emplace_back(segment.substr(1, segment.size() - 2));
+            }
+        }
+        if (hook->params.size() > MAX_ROUTE_PARAMS)
+        {
+            LOG_ERROR("Too many route params, method={}, target={}", bh::to_string(verb).to_string(), target);
+            return false;
+        }
+
+        std::lock_guard<std::mutex> lock(snapshots_->mutex);
+        const auto& table = snapshots_->current;
+        auto it = table->roots.find(verb);
+        // Routes differing only by the names of their params are the same route
+        auto root = insert(it == table->roots.end() ? nullptr : it->second.get(), path, hook);
+        if (root == nullptr)
         {
             LOG_ERROR("Duplicate registration, method={}, target={}", bh::to_string(verb).to_string(), target);
+            return false;
+        }
+        // Only a route that was added gets a series, the hook is not shared before it is published
+        if (metrics != nullptr)
+        {
+            hook->metrics = metrics->route(bh::to_string(verb).to_string(), hook->url);
         }
-        return ok;
+        auto next = std::make_shared<RouteTable>(*table);
+        next->roots[verb] = std::move(root);
+        snapshots_->publish(std::move(next));
+        return true;
     }
 
-    inline bool HandlerRegistrar::process(const SessionPtr& session)
+    inline bool HandlerRegistrar::remove(bh::verb verb, const std::string& target)
     {
-        const auto& met = session->request().method();
-        //std::lock_guard<std::mutex> lock(mutex_);
-        if (hooks_.count(met) == 0)
+        const auto& url = boost::to_lower_copy(target);
+        std::string_view path(url);
+        path = path.substr(0, path.find('?'));
+
+        std::lock_guard<std::mutex> lock(snapshots_->mutex);
+        const auto& table = snapshots_->current;
+        auto it = table->roots.find(verb);
+        if (it == table->roots.end())
         {
             return false;
         }
-
-        const auto& funcs = hooks_.at(met);
-        const std::string& href = session->href();
-        const std::string& schema = href.substr(0, href.find_first_of('?', 0));
-        auto ret = match(schema, funcs);
-        if (!ret.ok)
+        bool removed = false;
+        auto root = erase(it->second, path, removed);
+        if (!removed)
         {
             return false;
         }
-        for (const auto& a : ret.args)
+        auto next = std::make_shared<RouteTable>(*table);
+        if (root == nullptr)
+        {
+            next->roots.erase(verb);
+        }
+        else
         {
-            session->addArgument(a.first, a.second);
+            next->roots[verb] = std::move(root);
         }
-        ret.func.func(session);
+        snapshots_->publish(std::move(next));
         return true;
     }
 
+    inline const HandlerRegistrar::HookFunctor* HandlerRegistrar::find(Session& session)
+    {
+        const auto& met = session.request().method();
+        auto pinned = pin();
+        const auto& table = pinned.table();
+        auto root = table.roots.find(met);
+        if (root == table.roots.end())
+        {
+            return nullptr;
+        }
+
+        auto schema = session.path();
+        if (schema.find_first_of("<>[]") != std::string_view::npos)
+        {
+            return nullptr;
+        }
+
+        // The root route weighs 1, it still handles every path no other route matches
+        std::array<std::string_view, MAX_ROUTE_PARAMS> captures;
+        MatchedResult ret;
+        match(*root->second, schema, 1, 0, captures, ret);
+        if (ret.node == nullptr)
+        {
+            return nullptr;
+        }
+        const auto* hook = ret.node->hook.get();
+        for (size_t i = 0; i < hook->params.size(); ++i)
+        {
+            session.addArgument(hook->params[i], ret.args[i]);
+        }
+        session.route_ = std::move(pinned);
+        return hook;
+    }
+
 }  // namespace http
 
 using Route = http::Route;
@@ -16,8 +16,16 @@
 #include <vector>
 #include <array>
 #include <atomic>
+#include <algorithm>
+#include <memory>
+#include <cstring>
 #include <cstdint>
 #include <cassert>
+#include <cerrno>
+
+#ifdef __linux__
+#include <sys/socket.h>
+#endif
 
 static const int BUFFER_MAX_LEN = 0xFFFF;
 
@@ -26,6 +34,21 @@ class MulticastReceiver
 public:
     using Message = std::vector<uint8_t>;
     using MessageHandler = std::function<void(double time, const Message& msg)>;
+    // Views the receive slot directly, valid only during the call
+    using RawMessageHandler = std::function<void(double time, const uint8_t* data, size_t size)>;
+
+    struct BatchStats
+    {
+        size_t batchSize{ 1 };
+        uint64_t batches{ 0 };
+        uint64_t messages{ 0 };
+        uint64_t fullBatches{ 0 };
+
+        [[nodiscard]] double averageFill() const
+        {
+            return batches == 0 ? 0 : (double)messages / batches / batchSize;
+        }
+    };
 
 public:
     MulticastReceiver()
@@ -75,12 +98,26 @@ public:
         return *this;
     }
 
+    // Named apart from setMessageHandler, a lambda converting to both handler types would be ambiguous
+    MulticastReceiver& setRawMessageHandler(RawMessageHandler handler)
+    {
+        rawHandler_ = std::move(handler);
+        return *this;
+    }
+
+    // Datagrams drained per recvmmsg call, 1 receives one datagram per operation
+    MulticastReceiver& setBatchSize(size_t size)
+    {
+        batchSize_ = std::max<size_t>(size, 1);
+        return *this;
+    }
+
     bool start()
     {
         err_.clear();
 
-        assert(handler_ != nullptr);
-        if (handler_ == nullptr)
+        assert(handler_ != nullptr || rawHandler_ != nullptr);
+        if (handler_ == nullptr && rawHandler_ == nullptr)
         {
             err_ = "Invalid handler";
             LOG_ERROR(err_);
@@ -93,12 +130,6 @@ public:
             LOG_ERROR(err_);
             return false;
         }
-        if (handler_ == nullptr)
-        {
-            err_ = "Invalid message handler";
-            LOG_ERROR(err_);
-            return false;
-        }
         if (socket_.is_open())
         {
             err_ = "Duplicate socket open";
@@ -135,7 +166,19 @@ public:
                 }
             );
 
-            LOG_INFO("Multicast receiver started");
+#ifndef __linux__
+            // recvmmsg is Linux only, elsewhere every receive is a batch of one
+            batchSize_ = 1;
+#endif
+            LOG_INFO("Multicast receiver started, batch size={}", batchSize_);
+            prepareSlots();
+#ifdef __linux__
+            if (batchSize_ > 1)
+            {
+                doReceiveBatch();
+                return true;
+            }
+#endif
             doReceive();
             return true;
         }
@@ -174,30 +217,124 @@ public:
         return err_;
     }
 
+    [[nodiscard]] BatchStats batchStats() const
+    {
+        BatchStats s;
+        s.batchSize = batchSize_;
+        s.batches = batches_;
+        s.messages = batchMessages_;
+        s.fullBatches = fullBatches_;
+        return s;
+    }
+
 private:
     void doReceive()
     {
-        msg_.resize(BUFFER_MAX_LEN);
-        socket_.async_receive_from(boost::asio::buffer(msg_), sender_, [this](boost::system::error_code ec, std::size_t length)
+        socket_.async_receive_from(boost::asio::buffer(slots_.get(), BUFFER_MAX_LEN), sender_, [this](boost::system::error_code ec, std::size_t length)
+        {
+            if (ec)
+            {
+                LOG_ERROR("Receiving failed, {}", ec.message());
+                return;
+            }
+            // A batch of one, the stats read the same in both modes
+            batches_ += 1;
+            batchMessages_ += 1;
+            fullBatches_ += 1;
+            dispatch(TimeUtil::getCurrentEpochS(), slots_.get(), length);
+            doReceive();
+        });
+    }
+
+    // Slots are left uninitialized, a datagram only touches the bytes it was written into
+    void prepareSlots()
+    {
+        const size_t count = batchSize_;
+        slots_.reset(new uint8_t[count * BUFFER_MAX_LEN]);
+        if (handler_ != nullptr)
+        {
+            msg_.reserve(BUFFER_MAX_LEN);
+        }
+#ifdef __linux__
+        iovs_.resize(count);
+        msgs_.resize(count);
+        for (size_t i = 0; i < count; ++i)
+        {
+            iovs_[i].iov_base = slots_.get() + i * BUFFER_MAX_LEN;
+            iovs_[i].iov_len = BUFFER_MAX_LEN;
+            msgs_[i] = mmsghdr{};
+            msgs_[i].msg_hdr.msg_iov = &iovs_[i];
+            msgs_[i].msg_hdr.msg_iovlen = 1;
+        }
+#endif
+    }
+
+    void dispatch(double time, const uint8_t* data, size_t size)
+    {
+        if (rawHandler_ != nullptr)
+        {
+            rawHandler_(time, data, size);
+        }
+        if (handler_ != nullptr)
+        {
+            // Capacity is reserved up front, this copies size bytes and never allocates
+            msg_.assign(data, data + size);
+            handler_(time, msg_);
+        }
+
+        msgCount_ += 1;
+        if (msgCount_ % 10000 == 1)
+        {
+            LOG_DEBUG("Received total {} message", msgCount_);
+        }
+    }
+
+#ifdef __linux__
+    // Wait for readability, then drain the socket with recvmmsg until it would block
+    void doReceiveBatch()
+    {
+        socket_.async_wait(boost::asio::ip::udp::socket::wait_read, [this](boost::system::error_code ec)
         {
             if (ec)
             {
                 LOG_ERROR("Receiving failed, {}", ec.message());
+                return;
             }
-            else if (handler_ != nullptr)
+            for (;;)
             {
-                msg_.resize(length);
-                handler_(TimeUtil::getCurrentEpochS(), msg_);
-                doReceive();
+                int n = ::recvmmsg(socket_.native_handle(), msgs_.data(), (unsigned)msgs_.size(), MSG_DONTWAIT, nullptr);
+                if (n < 0 && errno == EINTR)
+                {
+                    continue;
+                }
+                if (n < 0 && (errno == EAGAIN || errno == EWOULDBLOCK))
+                {
+                    break;
+                }
+                if (n < 0)
+                {
+                    LOG_ERROR("Receiving failed, {}", strerror(errno));
+                    return;
+                }
+
+                batches_ += 1;
+                batchMessages_ += n;
+                fullBatches_ += (size_t)n == batchSize_ ? 1 : 0;
 
-                msgCount_ += 1;
-                if (msgCount_ % 10000 == 1)
+                auto now = TimeUtil::getCurrentEpochS();
+                for (int i = 0; i < n; ++i)
                 {
-                    LOG_DEBUG("Received total {} message", msgCount_);
+                    dispatch(now, static_cast<const uint8_t*>(iovs_[i].iov_base), msgs_[i].msg_len);
+                }
+                if ((size_t)n < batchSize_)
+                {
+                    break;
                 }
             }
+            doReceiveBatch();
         });
     }
+#endif
 
 private:
     boost::asio::io_context io_{ 1 };
@@ -209,7 +346,18 @@ private:
     std::string destIp_;
     uint16_t port_{ 0 };
     MessageHandler handler_;
+    RawMessageHandler rawHandler_;
     Message msg_;
     std::atomic<int> msgCount_{ 0 };
+
+    size_t batchSize_{ 1 };
+    std::atomic<uint64_t> batches_{ 0 };
+    std::atomic<uint64_t> batchMessages_{ 0 };
+    std::atomic<uint64_t> fullBatches_{ 0 };
+    std::unique_ptr<uint8_t[]> slots_;
+#ifdef __linux__
+    std::vector<iovec> iovs_;
+    std::vector<mmsghdr> msgs_;
+#endif
     std::string err_;
 };
\ No newline at end of file
@@ -0,0 +1,326 @@
+#pragma once
+
+#include <Logger/Logger.h>
+#include <boost/beast/zlib/deflate_stream.hpp>
+#include <boost/crc.hpp>
+#include <filesystem>
+#include <fstream>
+#include <chrono>
+#include <memory>
+#include <mutex>
+#include <list>
+#include <unordered_map>
+#include <string>
+#include <string_view>
+#include <cstdint>
+
+// gzip variants use the deflate bundled with Beast. Define to keep brotli variants too, the application then links brotlienc
+#ifdef ASULA_WITH_BROTLI
+#include <brotli/encode.h>
+#endif
+
+namespace http
+{
+    /**
+     * Bounded LRU cache of small static files, with their compressed variants computed once when loaded.
+     * An entry is checked against the file size and mtime at most once per revalidate interval,
+     * a changed file is loaded again on that request.
+     */
+    class StaticFileCache final
+    {
+    public:
+        struct Entry
+        {
+            std::string etag;
+            uint64_t size{ 0 };
+            std::filesystem::file_time_type mtime;
+            std::string identity;
+            // Empty when the type does not compress or compressing does not pay
+            std::string gzip;
+            std::string brotli;
+        };
+
+        using EntryPtr = std::shared_ptr<const Entry>;
+
+        struct Stats
+        {
+            uint64_t hits{ 0 };
+            uint64_t misses{ 0 };
+            uint64_t reloads{ 0 };
+            uint64_t evictions{ 0 };
+            size_t entries{ 0 };
+            size_t bytes{ 0 };
+        };
+
+    public:
+        explicit StaticFileCache(size_t capacity = 64 * 1024 * 1024,
+                                 size_t maxFileSize = 1024 * 1024,
+                                 std::chrono::milliseconds revalidate = std::chrono::seconds(1),
+                                 std::string cacheControl = "public, max-age=60")
+            : capacity_(capacity)
+            , maxFileSize_(maxFileSize)
+            , revalidate_(revalidate)
+            , cacheControl_(std::move(cacheControl))
+        {
+
+        }
+
+        StaticFileCache(const StaticFileCache&) = delete;
+        StaticFileCache& operator=(const StaticFileCache&) = delete;
+
+    public:
+        // Strong validator of a file version, also used for the files too large to be cached
+        static std::string makeEtag(uint64_t size, std::filesystem::file_time_type mtime)
+        {
+            auto ns = std::chrono::duration_cast<std::chrono::nanoseconds>(mtime.time_since_epoch()).count();
+            return fmt::format("\"{:x}-{:x}\"", size, (uint64_t)ns);
+        }
+
+        // Null when the file is missing, not regular or larger than the cacheable size, ec tells which
+        EntryPtr get(const std::string& path, std::string_view contentType, std::error_code& ec)
+        {
+            namespace fs = std::filesystem;
+            ec.clear();
+            const auto now = std::chrono::steady_clock::now();
+            EntryPtr cached;
+            {
+                std::lock_guard<std::mutex> lock(mutex_);
+                auto it = nodes_.find(path);
+                if (it != nodes_.end())
+                {
+                    lru_.splice(lru_.begin(), lru_, it->second.lru);
+                    if (now - it->second.checked < revalidate_)
+                    {
+                        hits_ += 1;
+                        return it->second.entry;
+                    }
+                    cached = it->second.entry;
+                }
+            }
+
+            // Stat outside the lock, other requests keep being served from memory meanwhile
+            auto status = fs::status(path, ec);
+            if (ec || !fs::is_regular_file(status))
+            {
+                if (!ec)
+                {
+                    ec = std::make_error_code(std::errc::is_a_directory);
+                }
+                erase(path);
+                return nullptr;
+            }
+            auto size = fs::file_size(path, ec);
+            auto mtime = ec ? fs::file_time_type() : fs::last_write_time(path, ec);
+            if (ec || size > maxFileSize_)
+            {
+                erase(path);
+                return nullptr;
+            }
+            if (cached != nullptr && cached->size == size && cached->mtime == mtime)
+            {
+                std::lock_guard<std::mutex> lock(mutex_);
+                auto it = nodes_.find(path);
+                if (it != nodes_.end())
+                {
+                    it->second.checked = now;
+                }
+                hits_ += 1;
+                return cached;
+            }
+
+            auto entry = load(path, size, mtime, contentType, ec);
+            if (entry == nullptr)
+            {
+                return nullptr;
+            }
+            insert(path, entry, now, cached != nullptr);
+            return entry;
+        }
+
+        // Cache-Control of the responses served from the cache
+        [[nodiscard]] const std::string& cacheControl() const
+        {
+            return cacheControl_;
+        }
+
+        void clear()
+        {
+            std::lock_guard<std::mutex> lock(mutex_);
+            nodes_.clear();
+            lru_.clear();
+            bytes_ = 0;
+        }
+
+        [[nodiscard]] Stats stats() const
+        {
+            std::lock_guard<std::mutex> lock(mutex_);
+            return Stats{ hits_, misses_, reloads_, evictions_, nodes_.size(), bytes_ };
+        }
+
+    private:
+        struct Node
+        {
+            EntryPtr entry;
+            std::list<std::string>::iterator lru;
+            std::chrono::steady_clock::time_point checked;
+        };
+
+        static size_t footprint(const Entry& e)
+        {
+            return e.identity.size() + e.gzip.size() + e.brotli.size();
+        }
+
+        static bool isCompressible(std::string_view contentType)
+        {
+            return contentType.substr(0, 5) == "text/"
+                || contentType.find("javascript") != std::string_view::npos
+                || contentType.find("json") != std::string_view::npos
+                || contentType.find("xml") != std::string_view::npos;
+        }
+
+        EntryPtr load(const std::string& path, uint64_t size, std::filesystem::file_time_type mtime, std::string_view contentType, std::error_code& ec)
+        {
+            auto entry = std::make_shared<Entry>();
+            entry->size = size;
+            entry->mtime = mtime;
+            entry->etag = makeEtag(size, mtime);
+            entry->identity.resize(size);
+            std::ifstream ifs(path, std::ios::binary);
+            if (!ifs.read(entry->identity.data(), (std::streamsize)size))
+            {
+                LOG_ERROR("Read static file failed, path={}", path);
+                ec = std::make_error_code(std::errc::io_error);
+                return nullptr;
+            }
+            if (isCompressible(contentType) && size > 0)
+            {
+                entry->gzip = gzip(entry->identity);
+                entry->brotli = brotli(entry->identity);
+            }
+            return entry;
+        }
+
+        void insert(const std::string& path, const EntryPtr& entry, std::chrono::steady_clock::time_point now, bool reload)
+        {
+            std::lock_guard<std::mutex> lock(mutex_);
+            reload ? reloads_ += 1 : misses_ += 1;
+            auto it = nodes_.find(path);
+            if (it != nodes_.end())
+            {
+                bytes_ -= footprint(*it->second.entry);
+                lru_.erase(it->second.lru);
+                nodes_.erase(it);
+            }
+            const auto len = footprint(*entry);
+            if (len > capacity_)
+            {
+                return;
+            }
+            while (bytes_ + len > capacity_ && !lru_.empty())
+            {
+                auto victim = nodes_.find(lru_.back());
+                bytes_ -= footprint(*victim->second.entry);
+                nodes_.erase(victim);
+                lru_.pop_back();
+                evictions_ += 1;
+            }
+            lru_.push_front(path);
+            nodes_.emplace(path, Node{ entry, lru_.begin(), now });
+            bytes_ += len;
+        }
+
+        void erase(const std::string& path)
+        {
+            std::lock_guard<std::mutex> lock(mutex_);
+            auto it = nodes_.find(path);
+            if (it != nodes_.end())
+            {
+                bytes_ -= footprint(*it->second.entry);
+                lru_.erase(it->second.lru);
+                nodes_.erase(it);
+            }
+        }
+
+        // A variant is kept only when it saves at least a tenth of the file
+        static bool worthIt(const std::string& data, size_t compressed)
+        {
+            return compressed < data.size() - data.size() / 10;
+        }
+
+        static std::string gzip(const std::string& data)
+        {
+            namespace zlib = boost::beast::zlib;
+            // Beast writes raw deflate, the gzip member header and trailer (RFC 1952) are added around it
+            static constexpr char header[] = { '\x1f', '\x8b', '\x08', 0, 0, 0, 0, 0, '\x02', '\xff' };
+            zlib::deflate_stream ds;
+            ds.reset(9, 15, 9, zlib::Strategy::normal);
+            std::string out(sizeof(header) + ds.upper_bound(data.size()) + 8, '\0');
+            std::copy(std::begin(header), std::end(header), out.begin());
+            zlib::z_params zs;
+            zs.next_in = data.data();
+            zs.avail_in = data.size();
+            zs.next_out = out.data() + sizeof(header);
+            zs.avail_out = out.size() - sizeof(header) - 8;
+            boost::beast::error_code ec;
+            ds.write(zs, zlib::Flush::finish, ec);
+            if (ec != zlib::error::end_of_stream)
+            {
+                return {};
+            }
+            boost::crc_32_type crc;
+            crc.process_bytes(data.data(), data.size());
+            auto len = sizeof(header) + zs.total_out;
+            // CRC32 and size modulo 2^32, both little endian
+            for (uint32_t v : { (uint32_t)crc.checksum(), (uint32_t)data.size() })
+            {
+                for (int i = 0; i < 4; ++i)
+                {
+                    out[len++] = (char)(v >> (8 * i));
+                }
+            }
+            out.resize(len);
+            if (worthIt(data, out.size()))
+            {
+                return out;
+            }
+            return {};
+        }
+
+        static std::string brotli(const std::string& data)
+        {
+#ifdef ASULA_WITH_BROTLI
+            // Quality 9 compresses a megabyte in milliseconds, 11 would stall the first request for a second
+            size_t len = BrotliEncoderMaxCompressedSize(data.size());
+            std::string out(len, '\0');
+            if (len > 0 && BrotliEncoderCompress(9, BROTLI_DEFAULT_WINDOW, BROTLI_MODE_TEXT, data.size(),
+                                                 (const uint8_t*)data.data(), &len, (uint8_t*)out.data()))
+            {
+                out.resize(len);
+                if (worthIt(data, out.size()))
+                {
+                    return out;
+                }
+            }
+#endif
+            (void)data;
+            return {};
+        }
+
+    private:
+        const size_t capacity_;
+        const size_t maxFileSize_;
+        const std::chrono::milliseconds revalidate_;
+        const std::string cacheControl_;
+
+        mutable std::mutex mutex_;
+        std::list<std::string> lru_;
+        std::unordered_map<std::string, Node> nodes_;
+        size_t bytes_{ 0 };
+        uint64_t hits_{ 0 };
+        uint64_t misses_{ 0 };
+        uint64_t reloads_{ 0 };
+        uint64_t evictions_{ 0 };
+    };
+
+    using StaticFileCachePtr = std::shared_ptr<StaticFileCache>;
+}  // namespace http
@@ -1,5 +1,6 @@
 #pragma once
 
+#include "WebSocketDeflate.hpp"
 #include <Logger/Logger.h>
 #include <boost/beast/core.hpp>
 #include <boost/beast/websocket.hpp>
@@ -52,7 +53,7 @@ namespace ws
         if (hasColon)
         {
             u.host = temp.substr(0, colonPos);
-            const std::string& portStr = temp.substr(colonPos + 1, hasSlash ? slashPos - colonPos : -1);
+            const std::string& portStr = temp.substr(colonPos + 1, hasSlash ? slashPos - colonPos - 1 : -1);
             try
             {
                 u.port = boost::lexical_cast<uint16_t>(portStr);
@@ -80,7 +81,7 @@ namespace ws
     public:
         Client(int threadCount = 1)
             : guard_(net::make_work_guard(io_))
-            , strand_(io_)
+            , strand_(net::make_strand(io_))
             , wstream_(io_)
         {
             for (auto i = 0; i < threadCount; ++i)
@@ -107,6 +108,12 @@ namespace ws
         }
 
     public:
+        // Call this method before open, the server may still decline compression
+        void setDeflate(const DeflateOptions& options)
+        {
+            deflate_ = options;
+        }
+
         bool open(const std::string& url)
         {
             const Url& u = UrlFromString(url);
@@ -138,6 +145,7 @@ namespace ws
             beast::get_lowest_layer(wstream_).expires_never();
 
             wstream_.set_option(websocket::stream_base::timeout::suggested(beast::role_type::client));
+            ws::setDeflate(wstream_, deflate_);
             wstream_.set_option(websocket::stream_base::decorator([](websocket::request_type& req)
             {
                 req.set(http::field::user_agent, WEBSOCKET_CLIENT_VERSION);
@@ -184,6 +192,7 @@ namespace ws
                 return;
             }
             boost::system::error_code ec;
+            ws::compressNext(wstream_, deflate_, message.size());
             wstream_.async_write(net::buffer(message), yield[ec]);
             if (ec)
             {
@@ -271,12 +280,13 @@ namespace ws
     private:
         net::io_context io_{ 1 };
         net::executor_work_guard<net::io_context::executor_type> guard_;
-        net::io_context::strand strand_;
+        net::strand<net::io_context::executor_type> strand_;
         websocket::stream<beast::tcp_stream> wstream_;
         std::vector<std::thread> workers_;
         std::atomic<bool> interrupted_{ false };
         std::shared_ptr<std::thread> receiveThread_{ nullptr };
         MessageHandler handler_{ nullptr };
+        DeflateOptions deflate_;
     };
 };
 
@@ -0,0 +1,66 @@
+#pragma once
+
+#include <Logger/Logger.h>
+#include <boost/beast/websocket.hpp>
+#include <algorithm>
+#include <cstddef>
+#include <mutex>
+
+namespace ws
+{
+    // permessage-deflate (RFC 7692) offered by one side of a WebSocket connection, used when the peer agrees
+    struct DeflateOptions
+    {
+        bool enabled{ false };
+        // LZ77 window of both directions, 9 to 15. A compressor keeps about 2^(windowBits + 2) bytes per connection
+        int windowBits{ 15 };
+        // false resets the window after every message, compressing less but keeping no memory between messages
+        bool contextTakeover{ true };
+        // zlib compression level 0..9 and memory level 1..9
+        int level{ 8 };
+        int memLevel{ 4 };
+        // Smaller messages are sent as they are, with a Beast providing stream::compress. Older ones compress every message
+        size_t minSize{ 128 };
+    };
+
+    // Call this function before the handshake, or before accepting it
+    template<class Stream>
+    void setDeflate(Stream& stream, const DeflateOptions& options)
+    {
+        boost::beast::websocket::permessage_deflate pmd;
+        pmd.server_enable = options.enabled;
+        pmd.client_enable = options.enabled;
+        // Below 9 hits a zlib bug
+        pmd.server_max_window_bits = std::clamp(options.windowBits, 9, 15);
+        pmd.client_max_window_bits = pmd.server_max_window_bits;
+        pmd.server_no_context_takeover = !options.contextTakeover;
+        pmd.client_no_context_takeover = !options.contextTakeover;
+        pmd.compLevel = std::clamp(options.level, 0, 9);
+        pmd.memLevel = std::clamp(options.memLevel, 1, 9);
+        stream.set_option(pmd);
+        if constexpr (!requires { stream.compress(false); })
+        {
+            if (options.enabled && options.minSize > 0)
+            {
+                static std::once_flag once;
+                std::call_once(once, [&options]
+                {
+                    LOG_WARN("Deflate minSize={} ignored, this Beast compresses every message", options.minSize);
+                });
+            }
+        }
+    }
+
+    // Call this function before every write, the message is compressed only from minSize bytes on
+    template<class Stream>
+    void compressNext(Stream& stream, const DeflateOptions& options, size_t size)
+    {
+        if constexpr (requires { stream.compress(false); })
+        {
+            if (options.enabled)
+            {
+                stream.compress(size >= options.minSize);
+            }
+        }
+    }
+}  // namespace ws
@@ -87,7 +87,8 @@ public:
 #define LOG_TRACE(...) if(Logger::logger())SPDLOG_LOGGER_TRACE   (Logger::logger(), __VA_ARGS__)
 #define LOG_DEBUG(...) if(Logger::logger())SPDLOG_LOGGER_DEBUG   (Logger::logger(), __VA_ARGS__)
 #define LOG_INFO(...)  if(Logger::logger())SPDLOG_LOGGER_INFO    (Logger::logger(), __VA_ARGS__)
-#define LOG_WARN(...)  if(Logger::logger())SPDLOG_LOGGER_WARN    (Logger::logger(), __VA_ARGS__
+#define LOG_WARN(...)  if(Logger::logger())SPDLOG_LOGGER_WARN    (Logger::logger(), __VA_ARGS__)
+#define LOG_ERROR(...) if(Logger::logger())SPDLOG_LOGGER_ERROR   (Logger::logger(), __VA_ARGS__)
 #define LOG_FATAL(...) if(Logger::logger())SPDLOG_LOGGER_CRITICAL(Logger::logger(), __VA_ARGS__)
 
 #endif